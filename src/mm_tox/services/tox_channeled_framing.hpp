@@ -0,0 +1,148 @@
+#pragma once
+
+#include <mm/services/net_channeled_interface.hpp>
+
+#include <mm_tox/utils/channel_table.hpp>
+
+#include <vector>
+#include <map>
+#include <functional>
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstddef>
+
+namespace MM::Tox::Services {
+
+// what ToxNetChanneled and ToxGroupNetChanneled have in common on the wire and on the receiving side.
+// byte 0 is the channel's wire id (see ToxChannelTable), byte 1 one of these.
+// the ids never change meaning, peers from before MM_HELLO (framing 0) treat anything but PKG_SMALL as 1 or 2
+enum ToxChanneledPkg : uint8_t {
+	PKG_SMALL = 0u,
+
+	// framing 0, still sent to friends that do not announce MM_TOX_FRAMING_VERSION >= 1
+	PKG_LEGACY_LARGE_PART = 1u,	// + data
+	PKG_LEGACY_LARGE_LAST = 2u,	// + data, completes the large packet
+
+	PKG_BATCH = 3u,				// (size (2), data)..., only sent to peers with CAP_BATCH
+	PKG_LOSSY_FRAG = 4u,		// + msg id (2), index (1), data count (1), group size (1), total size (4), data
+
+	// reliable-over-lossy, byte 0 is tox_reliable_wire_id, byte 2 the channel
+	PKG_REL_DATA = 5u,			// + channel (1), seq (2), part (1: 0 whole, 1 part, 2 last part), data
+	PKG_REL_ACK = 6u,			// + channel (1), next expected seq (2), bitmask of the 32 seqs after it (4)
+
+	PKG_SEQUENCED = 7u,			// + seq (2), data
+
+	// LZCodec compressed, only sent to peers with CAP_LZ
+	PKG_SMALL_LZ = 8u,			// + flags (1, bit 0: with dictionary), raw size (4), compressed data
+	PKG_LARGE_FIRST_LZ = 9u,	// like PKG_LARGE_FIRST, the reassembled data is a PKG_SMALL_LZ payload
+
+	// framing 1
+	PKG_LARGE_FIRST = 10u,		// + msg id (2), total size (4), data
+	PKG_LARGE_PART = 11u,		// + msg id (2), data
+};
+
+using ToxChanneledDefaultChannels = ToxChannels<
+	MM::Services::NetChanneledInterface::channel_type::LOSSLESS,
+	MM::Services::NetChanneledInterface::channel_type::LOSSLESS,
+	MM::Services::NetChanneledInterface::channel_type::LOSSLESS,
+	MM::Services::NetChanneledInterface::channel_type::LOSSLESS,
+	MM::Services::NetChanneledInterface::channel_type::LOSSLESS,
+	MM::Services::NetChanneledInterface::channel_type::LOSSLESS,
+	MM::Services::NetChanneledInterface::channel_type::LOSSLESS,
+	MM::Services::NetChanneledInterface::channel_type::LOSSLESS,
+	MM::Services::NetChanneledInterface::channel_type::LOSSLESS,
+	MM::Services::NetChanneledInterface::channel_type::LOSSLESS
+>;
+
+// either a view into ToxService's receive buffers (only valid until ToxService::pkg_cleanup), or owned
+struct ToxChanneledPacket {
+	uint8_t* data {nullptr};
+	size_t size {0};
+	std::vector<uint8_t> owned; // large packets and packets kept past their tick, data points in here
+};
+
+// received packets, per peer and channel.
+// consuming only marks a packet (O(1)), compact() removes them once per tick
+struct ToxChanneledQueue {
+	using peer_id = MM::Services::NetChanneledInterface::peer_id;
+	using channel_id = MM::Services::NetChanneledInterface::channel_id;
+
+	std::vector<ToxChanneledPacket> packets; // consumed ones stay as tombstones (data == nullptr)
+	size_t first_live {0}; // everything before is a tombstone
+
+	// returns the number of packets fn was called with
+	size_t consume(peer_id peer, channel_id channel, std::function<bool(peer_id, channel_id, uint8_t*, size_t)>& fn) {
+		size_t count = 0;
+
+		for (size_t i = first_live; i < packets.size(); i++) {
+			auto& pkg = packets[i];
+			if (pkg.data == nullptr) {
+				continue; // consumed
+			}
+
+			if (fn(peer, channel, pkg.data, pkg.size)) {
+				pkg.data = nullptr;
+				if (i == first_live) {
+					first_live++;
+				}
+			}
+			count++;
+		}
+
+		return count;
+	}
+
+	void compact(void) {
+		packets.erase(
+			std::remove_if(
+				packets.begin() + first_live, packets.end(),
+				[](const ToxChanneledPacket& pkg) { return pkg.data == nullptr; }
+			),
+			packets.end()
+		);
+		packets.erase(packets.begin(), packets.begin() + first_live);
+		first_live = 0;
+	}
+
+	// copies, for packets that have to outlive ToxService's buffers
+	void push_owned(const uint8_t* data, size_t size) {
+		auto& pkg = packets.emplace_back();
+		pkg.owned.assign(data, data + size);
+		pkg.data = pkg.owned.data();
+		pkg.size = pkg.owned.size();
+	}
+
+	void push_owned(std::vector<uint8_t>&& data) {
+		auto& pkg = packets.emplace_back();
+		pkg.owned = std::move(data);
+		pkg.data = pkg.owned.data();
+		pkg.size = pkg.owned.size();
+	}
+};
+
+// one large packet in flight per peer and channel (lossless, so parts arrive in order)
+struct ToxLargeReassembly {
+	uint16_t msg_id {0};
+	size_t total {0}; // 0 if nothing in progress
+	size_t received {0};
+	bool skip {false}; // rejected or canceled, ignore the rest of msg_id
+	bool streaming {false}; // parts go to the stream handler, data stays empty
+	bool compressed {false}; // PKG_LARGE_FIRST_LZ, never streamed
+	bool legacy {false}; // framing 0, no msg id and total grows with the parts, never streamed
+	std::vector<uint8_t> data; // reserved to total once, parts get appended
+	std::chrono::steady_clock::time_point last {};
+};
+
+// per channel state for a peer, sized to count on first use
+template<typename T>
+std::vector<T>& toxPeerChannels(std::map<MM::Services::NetChanneledInterface::peer_id, std::vector<T>>& per_peer, MM::Services::NetChanneledInterface::peer_id peer, size_t count) {
+	auto& chans = per_peer[peer];
+	if (chans.size() < count) {
+		chans.resize(count);
+	}
+	return chans;
+}
+
+} // MM::Tox::Services
+
@@ -96,7 +96,7 @@ void ToxChat::renderFriendGroupList(Engine& engine) {
 		ImGui::TableHeadersRow();
 
 		size_t table_id = 0;
-		for (auto& ge : ts._tox_groups) {
+		for (auto&& ge : ts._tox_groups) {
 			ImGui::TableNextRow();
 			ImGui::PushID(table_id++);
 
@@ -114,7 +114,7 @@ void ToxChat::renderFriendGroupList(Engine& engine) {
 			ImGui::PopID();
 		} // groups
 
-		for (auto& ce : ts._tox_conferences) {
+		for (auto&& ce : ts._tox_conferences) {
 			ImGui::TableNextRow();
 			ImGui::PushID(table_id++);
 
@@ -142,7 +142,9 @@ void ToxChat::renderFriendGroupList(Engine& engine) {
 			ImGui::PopID();
 		} // conferences
 
-		for (auto& fe : ts._tox_friends) {
+		for (auto&& fe : ts._tox_friends) {
+			const auto& fi = ts._tox_friends_info[fe.first];
+
 			ImGui::TableNextRow();
 			ImGui::PushID(table_id++);
 
@@ -157,10 +159,19 @@ void ToxChat::renderFriendGroupList(Engine& engine) {
 			if (ImGui::IsItemHovered()) {
 				ImGui::BeginTooltip();
 
-				ImGui::Text("Status: %s", fe.second.status_msg.c_str());
+				ImGui::Text("Status: %s", fi.status_msg.c_str());
 				if (fe.second.mm_instance) {
 					ImGui::Text("[MM]"); ImGui::SameLine();
-					ImGui::Text("[%s]", fe.second.mm_app.c_str());
+					ImGui::Text("[%s]", fi.mm_app.c_str());
+					if (const auto* hello = ts.friend_hello(fe.first); hello != nullptr) {
+						ImGui::Text("protocol: v%u framing: v%u caps: 0x%x", hello->protocol_version, hello->framing_version, ts.friend_caps_common(fe.first));
+					}
+
+					const auto& link = fe.second.link;
+					ImGui::Text("rtt: %.1fms jitter: %.1fms loss: %.1f%%", link.rtt_ms(), link.jitter_ms(), link.loss() * 100.f);
+					if (link.clock_synced()) {
+						ImGui::Text("clock offset: %.0fms", link.clock_offset_ms());
+					}
 				}
 
 				ImGui::EndTooltip();
@@ -174,9 +185,13 @@ void ToxChat::renderFriendGroupList(Engine& engine) {
 				fe.second.connection_status == Tox_Connection::TOX_CONNECTION_NONE ? "Offline" :
 				fe.second.connection_status == Tox_Connection::TOX_CONNECTION_UDP ? "UDP-Direct" : "TCP-Relay"
 			);
+			if (fe.second.mm_instance && fe.second.link.rtt_ms() > 0.f) {
+				ImGui::SameLine();
+				ImGui::Text("%.0fms", fe.second.link.rtt_ms());
+			}
 
 			ImGui::TableNextColumn();
-			ImGui::Text("%s", fe.second.name.c_str());
+			ImGui::Text("%s", fi.name.c_str());
 
 			//std::string f_context_str {"friend_context##"};
 			//f_context_str += std::to_string(fe.first);
@@ -187,7 +202,7 @@ void ToxChat::renderFriendGroupList(Engine& engine) {
 
 				//ImGui::Separator();
 
-				//for (auto& ge : ts._tox_groups) {
+				//for (auto&& ge : ts._tox_groups) {
 					//std::string inv_label {"invite to '"};
 					//inv_label += ge.second.title;
 					//inv_label += "'##";
@@ -281,7 +296,7 @@ void ToxChat::renderChats(Engine& engine) {
 					_active_chat.active = false;
 				}
 
-				std::string tab_title{ts._tox_friends[f_num].name};
+				std::string tab_title{ts._tox_friends_info[f_num].name};
 				tab_title += "##";
 				tab_title += std::to_string(f_num);
 				if (ImGui::BeginTabItem(tab_title.c_str(), NULL,
@@ -290,11 +305,11 @@ void ToxChat::renderChats(Engine& engine) {
 				)) {
 					ImGui::BeginChild("##scrollingregion", ImVec2(0, -23));
 
-					for (size_t i = 0; i < ts._tox_friends[f_num].messages.size(); i++) {
-						auto& msg_ent = ts._tox_friends[f_num].messages[i];
+					for (size_t i = 0; i < ts._tox_friends_info[f_num].messages.size(); i++) {
+						auto& msg_ent = ts._tox_friends_info[f_num].messages[i];
 						if (std::get<Tox_Message_Type>(msg_ent) == Tox_Message_Type::TOX_MESSAGE_TYPE_NORMAL) {
-							ImGui::Text("[%s]: %s", std::get<0>(msg_ent) ? "me" : ts._tox_friends[f_num].name.c_str(), std::get<2>(msg_ent).c_str());
-							if (follow && i == ts._tox_friends[f_num].messages.size()-1) {
+							ImGui::Text("[%s]: %s", std::get<0>(msg_ent) ? "me" : ts._tox_friends_info[f_num].name.c_str(), std::get<2>(msg_ent).c_str());
+							if (follow && i == ts._tox_friends_info[f_num].messages.size()-1) {
 								ImGui::SetScrollHereY(1.f);
 							}
 						}
@@ -0,0 +1,403 @@
+#include "./tox_group_net_channeled.hpp"
+
+#include <tox.h>
+
+#include <vector>
+#include <array>
+#include <algorithm>
+#include <cstring>
+
+#include <mm/logger.hpp>
+
+namespace MM::Tox::Services {
+
+// package structure, as ToxNetChanneled (see tox_channeled_framing.hpp):
+// byte
+// 0	: tox internal channel, mapped to channel_id (ToxChannelTable)
+// 1	: pkg type, PKG_SMALL, PKG_LARGE_FIRST or PKG_LARGE_PART
+// 2..	: the data
+//
+// sendPacketGroup() uses tox_group_send_custom_packet(), sendPacket() the private variant.
+// received packets are copied out of ToxService right away, so they survive pkg_cleanup.
+
+bool ToxGroupNetChanneled::enable(Engine& engine, std::vector<UpdateStrategies::TaskInfo>& task_array) {
+	_packets.clear();
+
+	_tox_service = engine.tryService<ToxService>();
+	if (!_tox_service) {
+		return false;
+	}
+
+	task_array.push_back(
+		UpdateStrategies::TaskInfo{"ToxGroupNetChanneled::pull_fresh_packages"}
+		.fn([this](Engine& e){ pull_fresh_packages(e); })
+		.succeed("ToxService::iterate")
+		.precede("SceneCollection::scene_tick") // evil hack
+	);
+
+	task_array.push_back(
+		UpdateStrategies::TaskInfo{"ToxGroupNetChanneled::send_queued"}
+		.fn([this](Engine& e){ send_queued(e); })
+		.phase(UpdateStrategies::update_phase_t::POST)
+	);
+
+	return true;
+}
+
+void ToxGroupNetChanneled::disable(Engine&) {
+	_packets.clear();
+	_large_packets_buffer.clear();
+	_send_queue.clear();
+
+	_tox_service = nullptr;
+}
+
+void ToxGroupNetChanneled::pull_fresh_packages(Engine&) {
+	for (auto& [peer, ch_data] : _packets) {
+		for (auto& ch_q : ch_data) {
+			ch_q.compact();
+		}
+	}
+
+	_tox_service->group_packet_each([this](uint32_t group_number, uint32_t group_peer_id, PacketView& pk) {
+		const peer_id peer = toNet(group_number, group_peer_id);
+		if (!_peer_list.count(peer)) {
+			return;
+		}
+
+		if (pk.size() < 3) {
+			// empty packet? (channel or pkg type missing)
+			return;
+		}
+
+		const channel_id channel = _channels.channel_of[pk[0]];
+		if (channel == ToxChannelTable::invalid) {
+			// not ours, other group custom packets
+			return;
+		}
+
+		if (pk[1] == PKG_SMALL) {
+			peerChannels(_packets, peer)[channel].push_owned(pk.data()+2, pk.size()-2);
+		} else if (_channels.lossless(channel)) {
+			receive_large(peer, channel, pk);
+		}
+	});
+
+	reclaim();
+}
+
+void ToxGroupNetChanneled::receive_large(peer_id peer, channel_id channel, PacketView& pk) {
+	auto& chans = peerChannels(_large_packets_buffer, peer);
+	auto& lpkg = chans[channel];
+
+	const size_t header_size = pk[1] == PKG_LARGE_FIRST ? 2+2+4 : 2+2;
+	if (pk.size() <= header_size || (pk[1] != PKG_LARGE_FIRST && pk[1] != PKG_LARGE_PART)) {
+		SPDLOG_WARN("malformed large group packet");
+		return;
+	}
+
+	const uint16_t msg_id = pk[2] | (uint16_t(pk[3]) << 8);
+
+	if (pk[1] == PKG_LARGE_FIRST) {
+		const size_t total = pk[4] | (size_t(pk[5]) << 8) | (size_t(pk[6]) << 16) | (size_t(pk[7]) << 24);
+
+		if (lpkg.total != 0) {
+			SPDLOG_WARN("large group packet {} from {} abandoned, {}/{} bytes", lpkg.msg_id, peer, lpkg.received, lpkg.total);
+		}
+
+		// new message, start over
+		lpkg.msg_id = msg_id;
+		lpkg.total = 0;
+		lpkg.received = 0;
+		lpkg.skip = false;
+		lpkg.data = {}; // frees
+
+		size_t peer_bytes = total;
+		for (const auto& other : chans) {
+			peer_bytes += other.total;
+		}
+
+		if (total == 0 || peer_bytes > _large_max_bytes_per_peer) {
+			SPDLOG_ERROR("large group packet from {} rejected, {} bytes", peer, total);
+			lpkg.skip = true;
+			return;
+		}
+
+		lpkg.total = total;
+		lpkg.data.reserve(total); // the only allocation
+	} else if (lpkg.skip && lpkg.msg_id == msg_id) {
+		return;
+	} else if (lpkg.total == 0 || lpkg.msg_id != msg_id) {
+		return; // start missed
+	}
+
+	lpkg.last = std::chrono::steady_clock::now();
+
+	const uint8_t* part = pk.data() + header_size;
+	const size_t part_size = pk.size() - header_size;
+	if (lpkg.received + part_size > lpkg.total) {
+		SPDLOG_ERROR("large group packet {} from {} is larger than announced, dropping", msg_id, peer);
+		lpkg.total = 0;
+		lpkg.received = 0;
+		lpkg.skip = true;
+		lpkg.data = {};
+		return;
+	}
+
+	lpkg.data.insert(lpkg.data.end(), part, part + part_size);
+	lpkg.received += part_size;
+
+	if (lpkg.received == lpkg.total) {
+		peerChannels(_packets, peer)[channel].push_owned(std::move(lpkg.data));
+		lpkg.total = 0;
+		lpkg.received = 0;
+		lpkg.data = {};
+	}
+}
+
+bool ToxGroupNetChanneled::peer_present(uint32_t group_number, uint32_t group_peer_id) const {
+	const auto* group = _tox_service->_tox_groups.find(group_number);
+	return group != nullptr && (group_peer_id == whole_group || group->peers.find(group_peer_id) != nullptr);
+}
+
+void ToxGroupNetChanneled::reclaim(void) {
+	const auto now = std::chrono::steady_clock::now();
+	if (now - _large_reclaim_last < std::chrono::seconds(1)) {
+		return;
+	}
+	_large_reclaim_last = now;
+
+	const auto gone = [this](peer_id peer) {
+		return !_peer_list.count(peer) || !peer_present(toGroupNumber(peer), toGroupPeer(peer));
+	};
+
+	for (auto it = _large_packets_buffer.begin(); it != _large_packets_buffer.end();) {
+		if (gone(it->first)) {
+			it = _large_packets_buffer.erase(it);
+			continue;
+		}
+
+		for (auto& lpkg : it->second) {
+			if (lpkg.total != 0 && now - lpkg.last > _large_timeout) {
+				SPDLOG_WARN("large group packet {} from {} timed out, {}/{} bytes", lpkg.msg_id, it->first, lpkg.received, lpkg.total);
+				lpkg.total = 0;
+				lpkg.received = 0;
+				lpkg.data = {};
+			}
+		}
+
+		it++;
+	}
+
+	for (auto it = _packets.begin(); it != _packets.end();) {
+		if (gone(it->first)) {
+			it = _packets.erase(it);
+		} else {
+			it++;
+		}
+	}
+
+	// would never leave
+	for (auto it = _send_queue.begin(); it != _send_queue.end();) {
+		if (!peer_present(toGroupNumber(it->first), toGroupPeer(it->first))) {
+			it = _send_queue.erase(it);
+		} else {
+			it++;
+		}
+	}
+}
+
+size_t ToxGroupNetChanneled::maxPacketSize(channel_id channel) const {
+	const size_t tox_max = _channels.lossless(channel) ? tox_group_max_custom_lossless_packet_length() : tox_group_max_custom_lossy_packet_length();
+	return tox_max - 2;
+}
+
+size_t ToxGroupNetChanneled::getMaxPacketSize(void) {
+	return std::min(tox_group_max_custom_lossless_packet_length(), tox_group_max_custom_lossy_packet_length()) - 2;
+}
+
+bool ToxGroupNetChanneled::send(uint32_t group_number, uint32_t group_peer_id, bool to_peer, channel_id channel, const uint8_t* data, size_t data_size) {
+	if (channel >= _channels.count) return false;
+	if (!data) return false;
+	if (data_size < 1) return false;
+
+	if (data_size > maxPacketSize(channel)) {
+		SPDLOG_ERROR("group packet too large ({} bytes)", data_size);
+		return false;
+	}
+
+	const uint8_t header[2] {_channels.wire_id[channel], PKG_SMALL};
+
+	const bool lossless = _channels.lossless(channel);
+	if (lossless) {
+		// behind a large packet still going out, has to wait for it
+		auto queue_it = _send_queue.find(toNet(group_number, to_peer ? group_peer_id : whole_group));
+		if (queue_it != _send_queue.end() && !queue_it->second.empty()) {
+			if (queue_it->second.size() >= _send_queue_max_packets) {
+				return false;
+			}
+			return queue_it->second.push(header, 2, data, data_size);
+		}
+	}
+
+	thread_local std::vector<uint8_t> new_data;
+	new_data.clear();
+	new_data.insert(new_data.end(), header, header + 2);
+	new_data.insert(new_data.end(), data, data + data_size);
+
+	if (to_peer) {
+		return _tox_service->group_send_packet_private(group_number, group_peer_id, lossless, new_data.data(), new_data.size());
+	} else {
+		return _tox_service->group_send_packet(group_number, lossless, new_data.data(), new_data.size());
+	}
+}
+
+bool ToxGroupNetChanneled::send_large(uint32_t group_number, uint32_t group_peer_id, bool to_peer, channel_id channel, const uint8_t* data, size_t data_size) {
+	if (channel >= _channels.count) return false;
+	if (!data) return false;
+	if (data_size < 1) return false;
+
+	if (data_size <= maxPacketSize(channel)) {
+		return send(group_number, group_peer_id, to_peer, channel, data, data_size);
+	}
+
+	if (!_channels.lossless(channel)) {
+		SPDLOG_ERROR("large group packets need a lossless channel");
+		return false;
+	}
+
+	if (data_size > UINT32_MAX) {
+		SPDLOG_ERROR("large group packet too large ({} bytes)", data_size);
+		return false;
+	}
+
+	const size_t tox_max = tox_group_max_custom_lossless_packet_length();
+	if (!peer_present(group_number, to_peer ? group_peer_id : whole_group)) {
+		return false; // would never leave the queue
+	}
+
+	// all parts are queued, send_queued() feeds them to toxcore as it takes them
+	auto& queue = _send_queue.try_emplace(toNet(group_number, to_peer ? group_peer_id : whole_group), tox_max).first->second;
+
+	const size_t first_data_size = tox_max - (2+2+4);
+	const size_t part_data_size = tox_max - (2+2);
+	const size_t parts = 1 + (data_size - first_data_size + part_data_size - 1) / part_data_size;
+	if (queue.size() + parts > _send_queue_max_packets) {
+		SPDLOG_WARN("group send queue full ({} packets)", queue.size());
+		return false;
+	}
+
+	const uint16_t msg_id = _large_msg_id_next++;
+
+	for (size_t offset = 0; offset < data_size;) {
+		const bool first = offset == 0;
+
+		std::array<uint8_t, 2+2+4> header {
+			_channels.wire_id[channel],
+			first ? uint8_t(PKG_LARGE_FIRST) : uint8_t(PKG_LARGE_PART),
+			uint8_t(msg_id & 0xff),
+			uint8_t((msg_id >> 8) & 0xff),
+		};
+		size_t header_size = 2+2;
+		if (first) {
+			for (size_t i = 0; i < 4; i++) {
+				header[header_size++] = (data_size >> (i*8)) & 0xff;
+			}
+		}
+
+		const size_t data_this_pk = std::min(data_size - offset, tox_max - header_size);
+		queue.push(header.data(), header_size, data + offset, data_this_pk);
+		offset += data_this_pk;
+	}
+
+	return true;
+}
+
+void ToxGroupNetChanneled::send_queued(Engine&) {
+	for (auto& [target, queue] : _send_queue) {
+		const uint32_t group_number = toGroupNumber(target);
+		const uint32_t group_peer_id = toGroupPeer(target);
+
+		while (!queue.empty()) {
+			const auto pkg = queue[0];
+			const bool succ = group_peer_id == whole_group
+				? _tox_service->group_send_packet(group_number, true, pkg.data(), pkg.size())
+				: _tox_service->group_send_packet_private(group_number, group_peer_id, true, pkg.data(), pkg.size());
+			if (!succ) {
+				break; // next tick, gone targets get dropped by reclaim()
+			}
+			queue.pop_front();
+		}
+
+		// a burst does not get to keep its memory
+		queue.shrink(send_queue_keep_slots);
+	}
+}
+
+bool ToxGroupNetChanneled::sendPacket(peer_id peer, channel_id channel, const uint8_t* data, size_t data_size) {
+	return send(toGroupNumber(peer), toGroupPeer(peer), true, channel, data, data_size);
+}
+
+bool ToxGroupNetChanneled::sendPacketLarge(peer_id peer, channel_id channel, const uint8_t* data, size_t data_size) {
+	return send_large(toGroupNumber(peer), toGroupPeer(peer), true, channel, data, data_size);
+}
+
+bool ToxGroupNetChanneled::sendPacketGroup(uint32_t group_number, channel_id channel, const uint8_t* data, size_t data_size) {
+	return send(group_number, 0, false, channel, data, data_size);
+}
+
+bool ToxGroupNetChanneled::sendPacketLargeGroup(uint32_t group_number, channel_id channel, const uint8_t* data, size_t data_size) {
+	return send_large(group_number, 0, false, channel, data, data_size);
+}
+
+size_t ToxGroupNetChanneled::forEachPacket(std::function<bool(peer_id, channel_id, uint8_t*, size_t)> fn) {
+	size_t count = 0;
+	for (auto&[peer, ch_data] : _packets) {
+		for (channel_id channel = 0; channel < ch_data.size(); channel++) {
+			count += ch_data[channel].consume(peer, channel, fn);
+		}
+	}
+
+	return count;
+}
+
+size_t ToxGroupNetChanneled::forEachPacketPeer(peer_id peer, std::function<bool(peer_id, channel_id, uint8_t*, size_t)> fn) {
+	// dont create entries for unknown peers
+	auto peer_it = _packets.find(peer);
+	if (peer_it == _packets.end()) {
+		return 0;
+	}
+
+	size_t count = 0;
+	for (channel_id channel = 0; channel < peer_it->second.size(); channel++) {
+		count += peer_it->second[channel].consume(peer, channel, fn);
+	}
+
+	return count;
+}
+
+size_t ToxGroupNetChanneled::forEachPacketPeerChannel(peer_id peer, channel_id channel, std::function<bool(peer_id, channel_id, uint8_t*, size_t)> fn) {
+	if (channel >= _channels.count) {
+		return 0;
+	}
+
+	// dont create entries for unknown peers
+	auto peer_it = _packets.find(peer);
+	if (peer_it == _packets.end()) {
+		return 0;
+	}
+
+	return peer_it->second[channel].consume(peer, channel, fn);
+}
+
+void ToxGroupNetChanneled::clearPackets(void) {
+	for (auto& [peer, ch_data] : _packets) {
+		for (auto& ch_q : ch_data) {
+			ch_q.packets.clear();
+			ch_q.first_live = 0;
+		}
+	}
+}
+
+} // MM::Tox::Services
+
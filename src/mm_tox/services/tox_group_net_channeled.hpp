@@ -0,0 +1,127 @@
+#pragma once
+
+#include <mm/services/net_channeled_interface.hpp>
+
+#include <mm_tox/services/tox_service.hpp>
+#include <mm_tox/services/tox_channeled_framing.hpp>
+#include <mm_tox/utils/channel_table.hpp>
+#include <mm_tox/utils/packet_ring.hpp>
+
+#include <vector>
+#include <map>
+#include <chrono>
+
+namespace MM::Tox::Services {
+
+// uses ToxService's NGC groups to provide the NetChanneledInterface service.
+// peers are group peers, they do not need to be friends with each other,
+// and sendPacketGroup() reaches the whole group with a single send.
+// peer_id is group_number << 32 | group peer_id, see toNet()
+class ToxGroupNetChanneled : public MM::Services::NetChanneledInterface {
+	protected:
+		ToxService* _tox_service = nullptr;
+
+	// service stuff
+	public:
+		ToxGroupNetChanneled(void) {}
+		// checked at compile time, eg ToxGroupNetChanneled{ToxChannels<channel_type::LOSSY, channel_type::LOSSLESS>{}}
+		template<channel_type... Types>
+		explicit ToxGroupNetChanneled(ToxChannels<Types...>) : _channels{ToxChannels<Types...>::table} {}
+
+		const char* name(void) override { return "ToxGroupNetChanneled"; }
+
+		bool enable(Engine& engine, std::vector<UpdateStrategies::TaskInfo>& task_array) override;
+		void disable(Engine& engine) override;
+
+	protected:
+		void pull_fresh_packages(Engine& engine);
+
+		// hands queued large packet parts to ToxService, as far as it takes them
+		void send_queued(Engine& engine);
+
+	// netservice stuff
+	protected:
+		using default_channels = ToxChanneledDefaultChannels;
+
+		// same wire ids and framing as ToxNetChanneled, see tox_channeled_framing.hpp.
+		// only PKG_SMALL, PKG_LARGE_FIRST and PKG_LARGE_PART are used
+		ToxChannelTable _channels {default_channels::table};
+
+		// per peer and channel, copied out of ToxService (owned), so they can be kept across ticks
+		std::map<peer_id, std::vector<ToxChanneledQueue>> _packets;
+
+		// lossless group packets of a peer arrive in order, so one per peer and channel
+		std::map<peer_id, std::vector<ToxLargeReassembly>> _large_packets_buffer;
+
+		// reassembly memory limit per peer, larger packets get dropped
+		size_t _large_max_bytes_per_peer {64*1024*1024};
+		// incomplete large packets are freed after this long without a new part
+		std::chrono::steady_clock::duration _large_timeout {std::chrono::seconds(30)};
+		std::chrono::steady_clock::time_point _large_reclaim_last {};
+
+		uint16_t _large_msg_id_next {0};
+
+		// per channel state for a peer, sized to _channels.count on first use
+		template<typename T>
+		std::vector<T>& peerChannels(std::map<peer_id, std::vector<T>>& per_peer, peer_id peer) {
+			return toxPeerChannels(per_peer, peer, _channels.count);
+		}
+
+		void receive_large(peer_id peer, channel_id channel, PacketView& pk);
+		// frees timed out reassemblies, and everything of peers that left, once per second
+		void reclaim(void);
+
+		// still in the group, according to ToxService
+		bool peer_present(uint32_t group_number, uint32_t group_peer_id) const;
+
+		// lossless packets, per target (toNet(group_number, whole_group) for the whole group).
+		// large packets are queued in full, so they never go out half way.
+		// small ones only queue up behind them, to keep the order
+		static constexpr uint32_t whole_group = UINT32_MAX;
+		std::map<peer_id, PacketRing> _send_queue;
+		// per target, beyond that, sends fail instead of piling up. also the largest large packet
+		size_t _send_queue_max_packets {1u << 12};
+		// drained queues keep at most this many slots
+		static constexpr size_t send_queue_keep_slots = 64;
+
+		// to_peer false sends to the whole group
+		bool send(uint32_t group_number, uint32_t group_peer_id, bool to_peer, channel_id channel, const uint8_t* data, size_t data_size);
+		bool send_large(uint32_t group_number, uint32_t group_peer_id, bool to_peer, channel_id channel, const uint8_t* data, size_t data_size);
+		size_t maxPacketSize(channel_id channel) const;
+
+	public:
+		channel_id getMaxChannels(void) override { return static_cast<channel_id>(_channels.count); }
+
+		bool getSupportedChannelType(channel_type) override { return true; } // both types are supported
+
+		// lossy group packets are smaller, this is the smaller of both
+		size_t getMaxPacketSize(void) override;
+
+		// private packets to a single group peer
+		bool sendPacket(peer_id peer, channel_id channel, const uint8_t* data, size_t data_size) override;
+		// lossless channels only, if larger than getMaxPacketSize()
+		bool sendPacketLarge(peer_id peer, channel_id channel, const uint8_t* data, size_t data_size) override;
+
+		// to everyone in the group, one send instead of one per peer
+		bool sendPacketGroup(uint32_t group_number, channel_id channel, const uint8_t* data, size_t data_size);
+		bool sendPacketLargeGroup(uint32_t group_number, channel_id channel, const uint8_t* data, size_t data_size);
+
+		size_t forEachPacket(std::function<bool(peer_id, channel_id, uint8_t*, size_t)> fn) override;
+		size_t forEachPacketPeer(peer_id peer, std::function<bool(peer_id, channel_id, uint8_t*, size_t)> fn) override;
+		size_t forEachPacketPeerChannel(peer_id peer, channel_id channel, std::function<bool(peer_id, channel_id, uint8_t*, size_t)> fn) override;
+
+		void clearPackets(void) override;
+
+	public: // large packets
+		void setLargeMaxBytesPerPeer(size_t bytes) { _large_max_bytes_per_peer = bytes; }
+		void setLargeTimeout(std::chrono::steady_clock::duration timeout) { _large_timeout = timeout; }
+		void setSendQueueMaxPackets(size_t packets) { _send_queue_max_packets = packets; }
+
+	public: // tox utilities
+		peer_id toNet(uint32_t group_number, uint32_t group_peer_id) const { return (peer_id(group_number) << 32) | group_peer_id; }
+		uint32_t toGroupNumber(peer_id peer) const { return static_cast<uint32_t>(peer >> 32); }
+		uint32_t toGroupPeer(peer_id peer) const { return static_cast<uint32_t>(peer & 0xffffffffu); }
+};
+
+} // MM::Tox::Services
+
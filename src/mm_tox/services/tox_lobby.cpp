@@ -0,0 +1,384 @@
+#include "./tox_lobby.hpp"
+
+#include <mm_tox/services/tox_service.hpp>
+#include <mm_tox/services/tox_net_channeled.hpp>
+
+#include <random>
+#include <algorithm>
+
+#include <mm/logger.hpp>
+#define LOG_ERROR(...)		__LOG_ERROR("MM::Tox", __VA_ARGS__)
+#define LOG_WARN(...)		__LOG_WARN(	"MM::Tox", __VA_ARGS__)
+#define LOG_INFO(...)		__LOG_INFO(	"MM::Tox", __VA_ARGS__)
+#define LOG_DEBUG(...)		__LOG_DEBUG("MM::Tox", __VA_ARGS__)
+
+namespace MM::Tox::Services {
+
+// lossless internal packets, after MM_TOX_LOSSLESS_PKG_ID_INTERNAL and the ToxInternalPkgID:
+// TOX_LOBBY_PUBLIC_INFO1	: lobby id (4), member count (2), member max (2), name
+// TOX_LOBBY_INVITE1		: same as TOX_LOBBY_PUBLIC_INFO1
+// TOX_LOBBY_JOIN			: lobby id (4)
+// TOX_LOBBY_JOIN_ACK		: lobby id (4), accepted (1)
+// TOX_LOBBY_LEAVE			: lobby id (4)
+// TOX_LOBBY_PING			: lobby id (4), host timestamp (4), the member sends it back as is
+
+static constexpr size_t lobby_name_max = 128;
+
+static void put_u16(std::vector<uint8_t>& pkg, uint16_t v) {
+	pkg.push_back(v & 0xff);
+	pkg.push_back((v >> 8) & 0xff);
+}
+
+static void put_u32(std::vector<uint8_t>& pkg, uint32_t v) {
+	for (size_t i = 0; i < 4; i++) {
+		pkg.push_back((v >> (i*8)) & 0xff);
+	}
+}
+
+static uint16_t get_u16(const uint8_t* data) {
+	return data[0] | (uint16_t(data[1]) << 8);
+}
+
+static uint32_t get_u32(const uint8_t* data) {
+	return data[0] | (uint32_t(data[1]) << 8) | (uint32_t(data[2]) << 16) | (uint32_t(data[3]) << 24);
+}
+
+// ms, wraps, only ever compared to itself
+static uint32_t lobby_timestamp(void) {
+	return static_cast<uint32_t>(std::chrono::duration_cast<std::chrono::milliseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()
+	).count());
+}
+
+bool ToxLobby::enable(Engine& engine, std::vector<UpdateStrategies::TaskInfo>& task_array) {
+	_tox_service = engine.tryService<ToxService>();
+	if (!_tox_service) {
+		LOG_ERROR("[ToxLobby] ToxService is not in engine");
+		return false;
+	}
+
+	_net = engine.tryService<ToxNetChanneled>();
+
+	task_array.push_back(
+		UpdateStrategies::TaskInfo{"ToxLobby::tick"}
+		.fn([this](Engine& e){ tick(e); })
+		.succeed("ToxService::iterate")
+	);
+
+	return true;
+}
+
+void ToxLobby::disable(Engine&) {
+	close();
+	leave();
+
+	_lobbies.clear();
+
+	_tox_service = nullptr;
+	_net = nullptr;
+}
+
+void ToxLobby::tick(Engine&) {
+	// only friends with traffic this tick
+	for (const uint32_t f_id : _tox_service->_tox_friends_active) {
+		_tox_service->friend_packet_each_lossless_internal(f_id, [this, f_id](PacketView& pk) {
+			handle_packet(f_id, pk.data(), pk.size());
+		});
+	}
+
+	const auto now = clock::now();
+
+	if (_join_state != JoinState::NONE && now - _join_last > _timeout) {
+		LOG_INFO("[ToxLobby] lobby of {} timed out", _join_host);
+		member_left();
+	}
+
+	// everything that walks tables, once per interval, not every tick
+	if (now - _ping_last >= _ping_interval) {
+		_ping_last = now;
+
+		if (_hosting) {
+			host_ping(now);
+		}
+
+		std::vector<uint32_t> expired;
+		for (auto&& [host, info] : _lobbies) {
+			if (!info.invited && now - info.last_seen > _public_info_interval * 3) {
+				expired.push_back(host);
+			}
+		}
+		for (const uint32_t host : expired) {
+			_lobbies.erase(host);
+		}
+	}
+
+	if (_hosting && _public && now - _public_info_last >= _public_info_interval) {
+		_public_info_last = now;
+		host_public_info(now);
+	}
+}
+
+void ToxLobby::handle_packet(uint32_t friend_number, const uint8_t* data, size_t size) {
+	if (size < 2+4) {
+		return; // not a lobby packet, or malformed
+	}
+
+	const uint8_t pkg_id = data[1];
+	const uint32_t lobby_id = get_u32(data + 2);
+	const auto now = clock::now();
+
+	switch (pkg_id) {
+		case ToxInternalPkgID::TOX_LOBBY_PUBLIC_INFO1:
+		case ToxInternalPkgID::TOX_LOBBY_INVITE1: {
+			if (size < 2+4+2+2) {
+				LOG_WARN("[ToxLobby] malformed lobby info from {}", friend_number);
+				return;
+			}
+
+			auto& info = _lobbies[friend_number];
+			if (info.lobby_id != lobby_id) {
+				info = {}; // a new one
+			}
+			info.lobby_id = lobby_id;
+			info.member_count = get_u16(data + 6);
+			info.member_max = get_u16(data + 8);
+			info.name = std::string_view{reinterpret_cast<const char*>(data + 10), std::min(size - 10, lobby_name_max)};
+			info.invited |= pkg_id == ToxInternalPkgID::TOX_LOBBY_INVITE1;
+			info.last_seen = now;
+			break;
+		}
+		case ToxInternalPkgID::TOX_LOBBY_JOIN: {
+			if (!_hosting) {
+				return;
+			}
+
+			const bool already = _members.contains(friend_number);
+			const bool accepted = lobby_id == _lobby_id && (already || _members.size() < _member_max);
+
+			auto pkg = make_pkg(ToxInternalPkgID::TOX_LOBBY_JOIN_ACK, lobby_id);
+			pkg.push_back(accepted ? 1 : 0);
+			send(friend_number, pkg);
+
+			if (accepted && !already) {
+				auto& member = _members[friend_number];
+				member.joined = now;
+				member.last_seen = now;
+
+				if (_net) {
+					_net->addPeer(_net->toNet(friend_number));
+				}
+				LOG_INFO("[ToxLobby] {} joined", friend_number);
+			}
+			break;
+		}
+		case ToxInternalPkgID::TOX_LOBBY_JOIN_ACK: {
+			if (size < 2+4+1 || _join_state != JoinState::REQUESTED || friend_number != _join_host || lobby_id != _join_lobby_id) {
+				return;
+			}
+
+			if (data[6] == 0) {
+				LOG_INFO("[ToxLobby] join rejected by {}", friend_number);
+				_join_state = JoinState::NONE;
+				return;
+			}
+
+			_join_state = JoinState::JOINED;
+			_join_last = now;
+			if (_net) {
+				_net->addPeer(_net->toNet(friend_number));
+			}
+			break;
+		}
+		case ToxInternalPkgID::TOX_LOBBY_LEAVE: {
+			if (_hosting && lobby_id == _lobby_id && _members.contains(friend_number)) {
+				host_remove(friend_number, false);
+			} else if (_join_state != JoinState::NONE && friend_number == _join_host && lobby_id == _join_lobby_id) {
+				member_left();
+			}
+
+			if (auto* info = _lobbies.find(friend_number); info != nullptr && info->lobby_id == lobby_id) {
+				_lobbies.erase(friend_number); // closed
+			}
+			break;
+		}
+		case ToxInternalPkgID::TOX_LOBBY_PING: {
+			if (size != 2+4+4) {
+				LOG_WARN("[ToxLobby] malformed lobby ping from {}", friend_number);
+				return;
+			}
+
+			if (_hosting && lobby_id == _lobby_id) {
+				// the answer
+				auto* member = _members.find(friend_number);
+				if (member == nullptr) {
+					return;
+				}
+				member->last_seen = now;
+				member->rtt_ms = static_cast<float>(lobby_timestamp() - get_u32(data + 6));
+			} else if (_join_state == JoinState::JOINED && friend_number == _join_host && lobby_id == _join_lobby_id) {
+				_join_last = now;
+
+				std::vector<uint8_t> pkg{data, data + size};
+				send(friend_number, pkg);
+			}
+			break;
+		}
+		default:
+			break; // not a lobby packet
+	}
+}
+
+void ToxLobby::host_ping(clock::time_point now) {
+	std::vector<uint32_t> evict;
+
+	auto pkg = make_pkg(ToxInternalPkgID::TOX_LOBBY_PING, _lobby_id);
+	put_u32(pkg, lobby_timestamp());
+
+	for (auto&& [f_id, member] : _members) {
+		if (now - member.last_seen > _timeout) {
+			evict.push_back(f_id);
+			continue;
+		}
+
+		send(f_id, pkg);
+	}
+
+	for (const uint32_t f_id : evict) {
+		LOG_INFO("[ToxLobby] {} timed out", f_id);
+		host_remove(f_id, true);
+	}
+}
+
+void ToxLobby::host_public_info(clock::time_point) {
+	auto pkg = make_pkg(ToxInternalPkgID::TOX_LOBBY_PUBLIC_INFO1, _lobby_id);
+	put_u16(pkg, static_cast<uint16_t>(_members.size()));
+	put_u16(pkg, _member_max);
+	pkg.insert(pkg.end(), _lobby_name.begin(), _lobby_name.end());
+
+	// once per interval, so walking all friends is fine
+	for (auto&& [f_id, f] : _tox_service->_tox_friends) {
+		if (f.connection_status == TOX_CONNECTION_NONE || !f.mm_instance || _members.contains(f_id)) {
+			continue;
+		}
+
+		send(f_id, pkg);
+	}
+}
+
+void ToxLobby::host_remove(uint32_t friend_number, bool send_leave) {
+	if (send_leave) {
+		auto pkg = make_pkg(ToxInternalPkgID::TOX_LOBBY_LEAVE, _lobby_id);
+		send(friend_number, pkg);
+	}
+
+	_members.erase(friend_number);
+
+	if (_net) {
+		_net->removePeer(_net->toNet(friend_number));
+	}
+}
+
+void ToxLobby::member_left(void) {
+	if (_join_state == JoinState::JOINED && _net) {
+		_net->removePeer(_net->toNet(_join_host));
+	}
+
+	_join_state = JoinState::NONE;
+}
+
+bool ToxLobby::send(uint32_t friend_number, std::vector<uint8_t>& pkg) {
+	return _tox_service->friend_send_packet_lossless(friend_number, pkg.data(), pkg.size());
+}
+
+std::vector<uint8_t> ToxLobby::make_pkg(uint8_t pkg_id, uint32_t lobby_id) const {
+	std::vector<uint8_t> pkg {MM_TOX_LOSSLESS_PKG_ID_INTERNAL, pkg_id};
+	put_u32(pkg, lobby_id);
+	return pkg;
+}
+
+bool ToxLobby::host(std::string_view name, uint16_t member_max, bool is_public) {
+	if (_tox_service == nullptr || _hosting || _join_state != JoinState::NONE) {
+		return false;
+	}
+
+	_hosting = true;
+	_public = is_public;
+	_lobby_id = std::random_device{}();
+	_lobby_name = name.substr(0, lobby_name_max);
+	_member_max = member_max;
+	_members.clear();
+	_public_info_last = {}; // announce right away
+
+	return true;
+}
+
+void ToxLobby::close(void) {
+	if (!_hosting) {
+		return;
+	}
+
+	std::vector<uint32_t> members;
+	for (auto&& [f_id, member] : _members) {
+		members.push_back(f_id);
+	}
+	for (const uint32_t f_id : members) {
+		host_remove(f_id, true);
+	}
+
+	_hosting = false;
+}
+
+bool ToxLobby::invite(uint32_t friend_number) {
+	if (!_hosting) {
+		return false;
+	}
+
+	auto pkg = make_pkg(ToxInternalPkgID::TOX_LOBBY_INVITE1, _lobby_id);
+	put_u16(pkg, static_cast<uint16_t>(_members.size()));
+	put_u16(pkg, _member_max);
+	pkg.insert(pkg.end(), _lobby_name.begin(), _lobby_name.end());
+
+	return send(friend_number, pkg);
+}
+
+bool ToxLobby::kick(uint32_t friend_number) {
+	if (!_hosting || !_members.contains(friend_number)) {
+		return false;
+	}
+
+	host_remove(friend_number, true);
+	return true;
+}
+
+bool ToxLobby::join(uint32_t host_friend_number) {
+	if (_tox_service == nullptr || _hosting || _join_state != JoinState::NONE) {
+		return false;
+	}
+
+	const auto* info = _lobbies.find(host_friend_number);
+	if (info == nullptr) {
+		return false;
+	}
+
+	_join_state = JoinState::REQUESTED;
+	_join_host = host_friend_number;
+	_join_lobby_id = info->lobby_id;
+	_join_last = clock::now();
+
+	auto pkg = make_pkg(ToxInternalPkgID::TOX_LOBBY_JOIN, _join_lobby_id);
+	return send(host_friend_number, pkg);
+}
+
+void ToxLobby::leave(void) {
+	if (_join_state == JoinState::NONE) {
+		return;
+	}
+
+	auto pkg = make_pkg(ToxInternalPkgID::TOX_LOBBY_LEAVE, _join_lobby_id);
+	send(_join_host, pkg);
+
+	member_left();
+}
+
+} // MM::Tox::Services
+
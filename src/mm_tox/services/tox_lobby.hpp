@@ -0,0 +1,127 @@
+#pragma once
+
+#include <mm/engine.hpp>
+
+#include <mm_tox/utils/dense_table.hpp>
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <chrono>
+#include <cstdint>
+
+namespace MM::Tox::Services {
+
+// fwd
+class ToxService;
+class ToxNetChanneled;
+
+// lobbies between friends, using the TOX_LOBBY_* internal packets.
+// the host pings its members, members that stop answering get evicted,
+// and a member not pinged by the host for a while considers the lobby gone.
+// joined peers are added to ToxNetChanneled's peer list (if enabled), and removed when they leave.
+// requires a ToxService to be enabled
+class ToxLobby : public MM::Services::Service {
+	public:
+		using clock = std::chrono::steady_clock;
+
+		// host side, friend_number
+		struct Member {
+			clock::time_point joined {};
+			clock::time_point last_seen {}; // last ping answer, or the join
+			float rtt_ms {0.f}; // of the last ping answer
+		};
+
+		// lobbies announced to us (public) or we got invited to, by host friend_number
+		struct LobbyInfo {
+			uint32_t lobby_id {0};
+			std::string name;
+			uint16_t member_count {0};
+			uint16_t member_max {0};
+			bool invited {false};
+			clock::time_point last_seen {};
+		};
+
+	protected:
+		ToxService* _tox_service = nullptr;
+		ToxNetChanneled* _net = nullptr; // optional
+
+		// host
+		bool _hosting {false};
+		bool _public {false};
+		uint32_t _lobby_id {0};
+		std::string _lobby_name;
+		uint16_t _member_max {0};
+		DenseTable<Member> _members; // friend_number
+		clock::time_point _ping_last {};
+		clock::time_point _public_info_last {};
+
+		// member
+		enum class JoinState {
+			NONE,
+			REQUESTED, // waiting for TOX_LOBBY_JOIN_ACK
+			JOINED,
+		} _join_state {JoinState::NONE};
+		uint32_t _join_host {0}; // friend_number
+		uint32_t _join_lobby_id {0};
+		clock::time_point _join_last {}; // request, or last ping from the host
+
+		DenseTable<LobbyInfo> _lobbies; // host friend_number
+
+		clock::duration _ping_interval {std::chrono::seconds(1)};
+		clock::duration _timeout {std::chrono::seconds(10)};
+		clock::duration _public_info_interval {std::chrono::seconds(5)};
+
+	public:
+		const char* name(void) override { return "ToxLobby"; }
+
+		bool enable(Engine& engine, std::vector<UpdateStrategies::TaskInfo>& task_array) override;
+		void disable(Engine& engine) override;
+
+	protected:
+		void tick(Engine& engine);
+
+		void handle_packet(uint32_t friend_number, const uint8_t* data, size_t size);
+
+		// host
+		void host_ping(clock::time_point now);
+		void host_public_info(clock::time_point now);
+		void host_remove(uint32_t friend_number, bool send_leave);
+
+		// member
+		void member_left(void);
+
+		bool send(uint32_t friend_number, std::vector<uint8_t>& pkg);
+		std::vector<uint8_t> make_pkg(uint8_t pkg_id, uint32_t lobby_id) const;
+
+	public: // host
+		// public lobbies get announced to all connected MushMachine friends
+		bool host(std::string_view name, uint16_t member_max, bool is_public);
+		// tells all members
+		void close(void);
+
+		bool invite(uint32_t friend_number);
+		bool kick(uint32_t friend_number);
+
+		bool isHosting(void) const { return _hosting; }
+		const DenseTable<Member>& getMembers(void) const { return _members; }
+
+	public: // member
+		// the host has to be known from getLobbies(), by announcement or invite
+		bool join(uint32_t host_friend_number);
+		void leave(void);
+
+		bool isJoined(void) const { return _join_state == JoinState::JOINED; }
+		// friend_number of the host, only valid if isJoined()
+		uint32_t getHost(void) const { return _join_host; }
+
+		const DenseTable<LobbyInfo>& getLobbies(void) const { return _lobbies; }
+
+	public: // settings
+		void setPingInterval(clock::duration interval) { _ping_interval = interval; }
+		// for both sides, without a ping (answer) for this long, the other side is gone
+		void setTimeout(clock::duration timeout) { _timeout = timeout; }
+};
+
+} // MM::Tox::Services
+
@@ -1,10 +1,12 @@
 #include "./tox_net_channeled.hpp"
 
 #include <mm_tox/services/tox_service.hpp>
+#include <mm_tox/utils/lz_codec.hpp>
 
 #include <entt/core/hashed_string.hpp>
 
 #include <vector>
+#include <algorithm>
 #include <cstring>
 
 #include <mm/logger.hpp>
@@ -15,8 +17,23 @@ namespace MM::Tox::Services {
 // lossless:
 // byte
 // 0	: tox internal channel, mapped to channel_id
-// 1	: large pkg indicator, 0 for not a large pkg, 1 for large pkg part, 2 for last large pkg part
+// 1	: pkg type, see ToxChanneledPkg
 // 2..	: the data
+//		  for batches: repeated 2 byte size + data
+//		  for large pkgs: 2 byte msg id, (first part only) 4 byte total size, then the data
+//		  for large pkgs to peers without MM_HELLO: just the data, the pkg type marks the last part
+// all sizes and ids are little endian
+//
+// received packets are not copied, _packets only holds views into ToxService's receive rings.
+// whatever is left at the end of the tick gets copied by retain_packets().
+//
+// outgoing lossless packets are queued per channel and sent at the end of the tick by send_scheduled():
+// strict priority between channels, deficit round robin by weight within a priority,
+// at most _send_budget bytes per peer, and nothing while toxcore is backed up for that peer.
+// so bulk transfers only fill what small high priority packets leave over.
+
+ToxNetChanneled::ToxNetChanneled(std::array<channel_type, 10>& c_types) : _channels{ToxChannelTable::legacy(c_types)} {
+}
 
 bool ToxNetChanneled::enable(Engine& engine, std::vector<UpdateStrategies::TaskInfo>& task_array) {
 	_packets.clear();
@@ -26,6 +43,10 @@ bool ToxNetChanneled::enable(Engine& engine, std::vector<UpdateStrategies::TaskI
 		return false;
 	}
 
+	// we can always decompress and unbatch
+	_tox_service->caps_set(_tox_service->caps_get() | CAP_LZ | CAP_BATCH | CAP_RELIABLE);
+	_tox_service->lz_dict_id_set(_lz_dict_id);
+
 	task_array.push_back(
 		UpdateStrategies::TaskInfo{"ToxNetChanneled::pull_fresh_packages"}
 		.fn([this](Engine& e){ pull_fresh_packages(e); })
@@ -33,17 +54,90 @@ bool ToxNetChanneled::enable(Engine& engine, std::vector<UpdateStrategies::TaskI
 		.precede("SceneCollection::scene_tick") // evil hack
 	);
 
+	task_array.push_back(
+		UpdateStrategies::TaskInfo{"ToxNetChanneled::retain_packets"}
+		.fn([this](Engine& e){ retain_packets(e); })
+		.phase(UpdateStrategies::update_phase_t::POST)
+		.precede("ToxService::pkg_cleanup")
+	);
+
+	task_array.push_back(
+		UpdateStrategies::TaskInfo{"ToxNetChanneled::flush_batches"}
+		.fn([this](Engine& e){ flush_batches(e); })
+		.phase(UpdateStrategies::update_phase_t::POST)
+	);
+
+	task_array.push_back(
+		UpdateStrategies::TaskInfo{"ToxNetChanneled::reliable_tick"}
+		.fn([this](Engine& e){ reliable_tick(e); })
+		.phase(UpdateStrategies::update_phase_t::POST)
+	);
+
+	task_array.push_back(
+		UpdateStrategies::TaskInfo{"ToxNetChanneled::send_scheduled"}
+		.fn([this](Engine& e){ send_scheduled(e); })
+		.phase(UpdateStrategies::update_phase_t::POST)
+		.succeed("ToxNetChanneled::flush_batches")
+	);
+
 	return true;
 }
 
 void ToxNetChanneled::disable(Engine&) {
 	_packets.clear(); // ?
+	_batch_buffer.clear();
+	_send_queue.clear();
+	_large_packets_buffer.clear();
+	_lossy_large_buffer.clear();
+	_reliable.clear();
+	_peer_generation.clear();
+	_sequenced.clear();
+	_lossy_buckets.clear();
 
+	if (_tox_service) {
+		_tox_service->caps_set(_tox_service->caps_get() & ~(CAP_LZ | CAP_BATCH | CAP_RELIABLE));
+		_tox_service->lz_dict_id_set(0);
+	}
 	_tox_service = nullptr;
 }
 
+// views into the batch, no copy
+void ToxNetChanneled::unpack_batch(ChannelQueue& queue, PacketView& pk) {
+	for (size_t i = 2; i < pk.size();) {
+		if (i + 2 > pk.size()) {
+			SPDLOG_WARN("malformed batch, size cut off");
+			return;
+		}
+
+		const size_t size = pk[i] | (size_t(pk[i+1]) << 8);
+		i += 2;
+
+		if (size == 0 || i + size > pk.size()) {
+			SPDLOG_WARN("malformed batch, bad size {}", size);
+			return;
+		}
+
+		queue.packets.push_back({pk.data()+i, size, {}});
+		i += size;
+	}
+}
+
 void ToxNetChanneled::pull_fresh_packages(Engine&) {
-	for (peer_id peer : _peer_list) {
+	// only friends with traffic this tick, not every peer
+	for (const uint32_t f_id : _tox_service->_tox_friends_active) {
+		const peer_id peer = toNet(f_id);
+		if (!_peer_list.count(peer)) {
+			continue;
+		}
+
+		if (const auto* f = _tox_service->_tox_friends.find(f_id); f != nullptr) {
+			auto gen_it = _peer_generation.find(peer);
+			if (gen_it == _peer_generation.end() || gen_it->second != f->connection_generation) {
+				_peer_generation[peer] = f->connection_generation;
+				peer_reconnected(peer);
+			}
+		}
+
 		_tox_service->friend_packet_each(toTox(peer), [this, peer](auto& pk) {
 			SPDLOG_INFO("got packet from {}", peer);
 
@@ -60,16 +154,39 @@ void ToxNetChanneled::pull_fresh_packages(Engine&) {
 				return;
 			}
 
-			channel_id channel = pk[0] - 192; // TODO: ugly
-			if (channel >= 10) {
+			if (pk[0] == tox_reliable_wire_id) {
+				receive_reliable(peer, pk);
+				return;
+			}
+
+			const channel_id channel = _channels.channel_of[pk[0]];
+			if (channel == ToxChannelTable::invalid || _channels.lossless(channel)) {
 				// invalid channel
 				return;
 			}
 
-			// lossy has no large packages ?
-			//bool large_packet = pk.value()[1] != 0;
+			if (pk[1] == PKG_BATCH) {
+				unpack_batch(peerChannels(_packets, peer)[channel], pk);
+				return;
+			}
+
+			if (pk[1] == PKG_LOSSY_FRAG) {
+				receive_lossy_large(peer, channel, pk);
+				return;
+			}
+
+			if (pk[1] == PKG_SEQUENCED) {
+				receive_sequenced(peer, channel, pk);
+				return;
+			}
 
-			_packets[peer][channel].emplace_back(pk.cbegin()+2, pk.cend());
+			if (pk[1] == PKG_SMALL_LZ) {
+				receive_compressed(peer, channel, pk);
+				return;
+			}
+
+			// no copy, skip the header
+			peerChannels(_packets, peer)[channel].packets.push_back({pk.data()+2, pk.size()-2, {}});
 		});
 
 		_tox_service->friend_packet_each_lossless(toTox(peer), [this, peer](auto& pk) {
@@ -91,171 +208,1788 @@ void ToxNetChanneled::pull_fresh_packages(Engine&) {
 			}
 
 			// channel 160 is reserved for tox control pkgs
-			channel_id channel = pk[0] - 161; // TODO: ugly
-			if (channel >= 10) {
+			const channel_id channel = _channels.channel_of[pk[0]];
+			if (channel == ToxChannelTable::invalid || !_channels.lossless(channel)) {
 				SPDLOG_WARN("invalid channel");
 				// invalid channel
 				return;
 			}
 
-			bool large_packet = pk[1] != 0;
+			if (pk[1] == PKG_BATCH) {
+				SPDLOG_TRACE("its a batch");
+				unpack_batch(peerChannels(_packets, peer)[channel], pk);
+				return;
+			}
 
-			if (!large_packet) {
+			if (pk[1] == PKG_SMALL) {
 				SPDLOG_TRACE("its a small one");
-				// TODO: is memcpy faster? prob
-				_packets[peer][channel].emplace_back(pk.cbegin()+2, pk.cend());
+				// no copy, skip the header
+				peerChannels(_packets, peer)[channel].packets.push_back({pk.data()+2, pk.size()-2, {}});
+			} else if (pk[1] == PKG_SMALL_LZ) {
+				receive_compressed(peer, channel, pk);
+			} else if (pk[1] == PKG_LEGACY_LARGE_PART || pk[1] == PKG_LEGACY_LARGE_LAST) {
+				receive_large_legacy(peer, channel, pk);
 			} else {
 				SPDLOG_TRACE("its a large one!");
-				auto& lpkg_buff = _large_packets_buffer[peer][channel];
+				receive_large(peer, channel, pk);
+			}
+		});
+	}
 
-				uint8_t lpkg_num = pk[1];
+	reclaim_large_packets();
+}
+
+void ToxNetChanneled::receive_large(peer_id peer, channel_id channel, PacketView& pk) {
+	auto& chans = peerChannels(_large_packets_buffer, peer);
+	auto& lpkg = chans[channel];
 
-				size_t pk_data_size = pk.size() - 2;
-				size_t old_lpkg_buff_size = lpkg_buff.size();
-				lpkg_buff.resize(old_lpkg_buff_size + pk_data_size);
-				std::memcpy(lpkg_buff.data() + old_lpkg_buff_size, pk.data() + 2, pk_data_size);
+	const bool first = pk[1] == PKG_LARGE_FIRST || pk[1] == PKG_LARGE_FIRST_LZ;
+	const size_t header_size = first ? 2+2+4 : 2+2;
+	if (pk.size() <= header_size || (!first && pk[1] != PKG_LARGE_PART)) {
+		SPDLOG_WARN("malformed large packet");
+		return;
+	}
 
-				// lossless tox packet arrive in order
-				if (lpkg_num == 2) { // magic value
-					// last part
-					SPDLOG_TRACE("and the last part!");
+	const uint16_t msg_id = pk[2] | (uint16_t(pk[3]) << 8);
 
-					_packets[peer][channel].emplace_back(lpkg_buff.cbegin(), lpkg_buff.cend());
-					lpkg_buff.clear();
-				}
+	if (first) {
+		const size_t total = pk[4] | (size_t(pk[5]) << 8) | (size_t(pk[6]) << 16) | (size_t(pk[7]) << 24);
+
+		if (lpkg.total != 0) {
+			abort_large(peer, channel, lpkg, "abandoned");
+		}
+
+		// new message, start over
+		lpkg.msg_id = msg_id;
+		lpkg.received = 0;
+		lpkg.skip = false;
+		lpkg.legacy = false;
+		lpkg.compressed = pk[1] == PKG_LARGE_FIRST_LZ;
+		// the handler wants the real data
+		lpkg.streaming = static_cast<bool>(_large_stream_fns[channel]) && !lpkg.compressed;
+
+		if (total == 0) {
+			SPDLOG_ERROR("large packet from {} rejected, no size", peer);
+			lpkg.skip = true;
+			return;
+		}
 
+		if (!lpkg.streaming) {
+			size_t peer_bytes = total;
+			for (const auto& other : chans) {
+				if (!other.streaming) {
+					peer_bytes += other.total;
+				}
+			}
+			if (peer_bytes > _large_max_bytes_per_peer) {
+				SPDLOG_ERROR("large packet from {} rejected, {} bytes would exceed the limit", peer, total);
+				lpkg.skip = true;
+				return;
 			}
+
+			lpkg.data.reserve(total); // the only allocation
+		}
+
+		lpkg.total = total;
+	} else if (lpkg.skip && !lpkg.legacy && lpkg.msg_id == msg_id) {
+		return;
+	} else if (lpkg.total == 0 || lpkg.legacy || lpkg.msg_id != msg_id) {
+		SPDLOG_WARN("large packet part without start from {}", peer);
+		return;
+	}
+
+	lpkg.last = std::chrono::steady_clock::now();
+
+	const uint8_t* part = pk.data() + header_size;
+	const size_t part_size = pk.size() - header_size;
+	if (lpkg.received + part_size > lpkg.total) {
+		SPDLOG_ERROR("large packet {} from {} is larger than announced, dropping", msg_id, peer);
+		abort_large(peer, channel, lpkg, nullptr);
+		lpkg.skip = true;
+		return;
+	}
+
+	const size_t offset = lpkg.received;
+	lpkg.received += part_size;
+	const bool complete = lpkg.received == lpkg.total;
+
+	if (lpkg.streaming && !_large_stream_fns[channel]) {
+		// handler removed mid message, the start of it is gone already
+		abort_large(peer, channel, lpkg, "stream handler removed");
+		lpkg.skip = true;
+		return;
+	}
+
+	if (lpkg.streaming) {
+		// straight from toxcore's buffer, no copy
+		const bool keep_going = _large_stream_fns[channel](LargeStreamPart{
+			peer, channel, msg_id,
+			part, part_size,
+			offset, lpkg.total,
+			complete, false
 		});
+
+		if (complete) {
+			lpkg.total = 0;
+		} else if (!keep_going) {
+			SPDLOG_DEBUG("large packet {} from {} canceled by consumer", msg_id, peer);
+			lpkg.total = 0;
+			lpkg.skip = true;
+		}
+		return;
+	}
+
+	lpkg.data.insert(lpkg.data.end(), part, part + part_size);
+
+	if (complete) {
+		SPDLOG_TRACE("and the last part!");
+
+		if (lpkg.compressed) {
+			std::vector<uint8_t> raw;
+			if (decompress_payload(peer, channel, lpkg.data.data(), lpkg.data.size(), raw)) {
+				auto& new_pkg = peerChannels(_packets, peer)[channel].packets.emplace_back();
+				new_pkg.owned = std::move(raw);
+				new_pkg.data = new_pkg.owned.data();
+				new_pkg.size = new_pkg.owned.size();
+			}
+
+			lpkg.total = 0;
+			lpkg.data = {};
+			return;
+		}
+
+		// hand over the buffer itself
+		auto& new_pkg = peerChannels(_packets, peer)[channel].packets.emplace_back();
+		new_pkg.owned = std::move(lpkg.data);
+		new_pkg.data = new_pkg.owned.data();
+		new_pkg.size = new_pkg.owned.size();
+
+		lpkg.total = 0;
+		lpkg.data = {};
 	}
 }
 
-bool ToxNetChanneled::sendPacket(peer_id peer, channel_id channel, const uint8_t* data, size_t data_size) {
-	if (channel >= 10) return false;
-	if (!data) return false;
-	if (data_size < 1) return false;
+void ToxNetChanneled::setChannelCompression(channel_id channel, bool enable, size_t min_size) {
+	if (channel >= _channels.count) {
+		return;
+	}
 
-	std::vector<uint8_t> new_data;
+	_c_compression[channel].enabled = enable;
+	_c_compression[channel].min_size = min_size;
+}
 
-	// TODO: this is ugly
-	// map to tox channels
-	if (_c_type_arr[channel] == channel_type::LOSSLESS) {
-		new_data.push_back(161 + channel);
-	} else {
-		new_data.push_back(192 + channel);
+void ToxNetChanneled::setChannelCompressionDict(channel_id channel, std::vector<uint8_t> dict) {
+	if (channel >= _channels.count) {
+		return;
 	}
 
-	// not a large packet
-	new_data.push_back(0);
+	_c_compression[channel].dict = std::move(dict);
+	update_lz_dict_id();
+}
 
-	size_t new_data_size_before = new_data.size();
-	new_data.resize(new_data_size_before + data_size);
+void ToxNetChanneled::update_lz_dict_id(void) {
+	// fnv-1a over channel, size and contents of every dictionary
+	uint32_t hash = 2166136261u;
+	bool any = false;
+	const auto mix = [&hash](uint8_t byte) {
+		hash ^= byte;
+		hash *= 16777619u;
+	};
 
-	// i hate those
-	std::memcpy(new_data.data()+new_data_size_before, data, data_size);
+	for (size_t channel = 0; channel < _channels.count; channel++) {
+		const auto& dict = _c_compression[channel].dict;
+		if (dict.empty()) {
+			continue;
+		}
+		any = true;
 
-	if (_c_type_arr[channel] == channel_type::LOSSLESS) {
-		return _tox_service->friend_send_packet_lossless(toTox(peer), new_data.data(), new_data.size());
-	} else {
-		return _tox_service->friend_send_packet(toTox(peer), new_data.data(), new_data.size());
+		mix(static_cast<uint8_t>(channel));
+		for (size_t i = 0; i < 4; i++) {
+			mix((dict.size() >> (i*8)) & 0xff);
+		}
+		for (const uint8_t byte : dict) {
+			mix(byte);
+		}
 	}
 
-	return true; // skipped
+	_lz_dict_id = !any ? 0 : (hash == 0 ? 1 : hash);
+
+	if (_tox_service) {
+		_tox_service->lz_dict_id_set(_lz_dict_id);
+	}
 }
 
-bool ToxNetChanneled::sendPacketLarge(peer_id peer, channel_id channel, const uint8_t* data, size_t data_size) {
-	if (channel >= 10) return false;
-	if (!data) return false;
-	if (data_size < 1) return false;
-	if (_c_type_arr[channel] != channel_type::LOSSLESS) return false;
+bool ToxNetChanneled::peer_lz_dict(peer_id peer) const {
+	if (_lz_dict_id == 0) {
+		return false;
+	}
 
-	if (data_size <= getMaxPacketSize()) {
-		return sendPacket(peer, channel, data, data_size);
+	const auto* hello = _tox_service->friend_hello(toTox(peer));
+	return hello != nullptr && hello->lz_dict_id == _lz_dict_id;
+}
+
+bool ToxNetChanneled::compress_payload(peer_id peer, channel_id channel, const uint8_t* data, size_t data_size, std::vector<uint8_t>& out) {
+	if (!(_tox_service->friend_caps(toTox(peer)) & CAP_LZ)) {
+		return false; // old peer
 	}
 
-	bool succ = true;
+	return compress_payload(channel, data, data_size, peer_lz_dict(peer), out);
+}
+
+bool ToxNetChanneled::compress_payload(channel_id channel, const uint8_t* data, size_t data_size, bool use_dict, std::vector<uint8_t>& out) {
+	const auto& comp = _c_compression[channel];
+	if (!comp.enabled || data_size < comp.min_size || data_size > UINT32_MAX) {
+		return false;
+	}
+
+	const size_t out_size_before = out.size();
+	const bool with_dict = use_dict && !comp.dict.empty();
+
+	out.reserve(out_size_before + lz_header_size + LZCodec::bound(data_size));
+	out.push_back(with_dict ? 0x01 : 0x00);
+	for (size_t i = 0; i < 4; i++) {
+		out.push_back((data_size >> (i*8)) & 0xff);
+	}
 
-	for (size_t remaining_data_size = data_size; remaining_data_size > 0;/* remaining_data_size -= getMaxPacketSize()*/) {
-		std::vector<uint8_t> new_data;
-		new_data.reserve(getMaxPacketSize() + 4); // to avoid reallocs
+	LZCodec::compress(data, data_size, out, with_dict ? comp.dict.data() : nullptr, comp.dict.size());
 
-		size_t data_this_pk = std::min(remaining_data_size, getMaxPacketSize());
+	if (out.size() - out_size_before >= data_size) {
+		// not worth it
+		out.resize(out_size_before);
+		return false;
+	}
 
-		// lossless channels
-		new_data.push_back(161 + channel);
+	return true;
+}
 
-		// a large packet
-		new_data.push_back(remaining_data_size <= getMaxPacketSize() ? 2 : 1); // 1 for lp part, 2 for last lp part
+bool ToxNetChanneled::decompress_payload(peer_id peer, channel_id channel, const uint8_t* data, size_t data_size, std::vector<uint8_t>& out) {
+	if (data_size < lz_header_size) {
+		SPDLOG_WARN("malformed compressed packet from {}", peer);
+		return false;
+	}
 
-		size_t new_data_size_before = new_data.size();
-		new_data.resize(new_data_size_before + data_this_pk);
+	const bool with_dict = data[0] & 0x01;
+	const size_t raw_size = data[1] | (size_t(data[2]) << 8) | (size_t(data[3]) << 16) | (size_t(data[4]) << 24);
 
-		// i hate those, but theyr fast
-		std::memcpy(new_data.data()+new_data_size_before, data + (data_size - remaining_data_size), data_this_pk);
+	const auto& dict = _c_compression[channel].dict;
+	if (with_dict && dict.empty()) {
+		SPDLOG_ERROR("compressed packet from {} needs a dictionary for channel {}, we have none", peer, channel);
+		return false;
+	}
 
-		succ &= _tox_service->friend_send_packet_lossless(toTox(peer), new_data.data(), new_data.size());
-		if (!succ) {
-			SPDLOG_ERROR("failed to send partial large packet packet");
-			break;
-		}
+	if (raw_size > _large_max_bytes_per_peer) {
+		SPDLOG_ERROR("compressed packet from {} rejected, {} bytes would exceed the limit", peer, raw_size);
+		return false;
+	}
 
-		remaining_data_size -= data_this_pk;
+	// do not allocate what the payload can not possibly hold (a single packet: ~350KiB at most)
+	if (raw_size > LZCodec::max_decompressed(data_size - lz_header_size)) {
+		SPDLOG_ERROR("compressed packet from {} rejected, {} bytes can not decompress to {}", peer, data_size - lz_header_size, raw_size);
+		return false;
 	}
 
-	return succ;
+	out.resize(raw_size);
+	if (!LZCodec::decompress(data + lz_header_size, data_size - lz_header_size, out.data(), raw_size, with_dict ? dict.data() : nullptr, dict.size())) {
+		SPDLOG_ERROR("corrupted compressed packet from {}", peer);
+		return false;
+	}
+
+	return true;
 }
 
-size_t ToxNetChanneled::forEachPacket(std::function<bool(peer_id, channel_id, uint8_t*, size_t)> fn) {
-	size_t count = 0;
-	for (auto&[peer, ch_data] : _packets) {
-		for (channel_id channel = 0; channel < 10; channel++) {
-			for (auto it = ch_data[channel].begin(); it != ch_data[channel].end();) {
-				if (fn(peer, channel, it->data(), it->size())) {
-					it = ch_data[channel].erase(it);
-				} else {
-					it++;
-				}
-				count++;
+void ToxNetChanneled::receive_compressed(peer_id peer, channel_id channel, PacketView& pk) {
+	std::vector<uint8_t> raw;
+	if (!decompress_payload(peer, channel, pk.data()+2, pk.size()-2, raw)) {
+		return;
+	}
+
+	auto& new_pkg = peerChannels(_packets, peer)[channel].packets.emplace_back();
+	new_pkg.owned = std::move(raw);
+	new_pkg.data = new_pkg.owned.data();
+	new_pkg.size = new_pkg.owned.size();
+}
+
+void ToxNetChanneled::setChannelSequenced(channel_id channel, sequencing mode) {
+	if (channel >= _channels.count || _channels.lossless(channel)) {
+		return;
+	}
+
+	_c_sequencing[channel] = mode;
+}
+
+bool ToxNetChanneled::getSequencedStats(peer_id peer, channel_id channel, SequencedStats& stats) const {
+	const auto it = _sequenced.find(peer);
+	if (it == _sequenced.end() || channel >= it->second.size() || !it->second[channel].received_any) {
+		return false;
+	}
+
+	stats = it->second[channel].stats;
+	return true;
+}
+
+void ToxNetChanneled::receive_sequenced(peer_id peer, channel_id channel, PacketView& pk) {
+	if (_c_sequencing[channel] == sequencing::NONE) {
+		SPDLOG_WARN("sequenced packet on a channel that is not sequenced");
+		return;
+	}
+
+	if (pk.size() < 2+2+1) {
+		SPDLOG_WARN("malformed sequenced packet");
+		return;
+	}
+
+	auto& sc = peerChannels(_sequenced, peer)[channel];
+
+	const uint16_t seq = pk[2] | (uint16_t(pk[3]) << 8);
+	if (sc.received_any) {
+		// wraps around
+		const int16_t dist = static_cast<int16_t>(seq - sc.newest);
+		if (dist == 0) {
+			sc.stats.duplicates++;
+			return;
+		} else if (dist < 0) {
+			sc.stats.stale++;
+			return;
+		}
+	}
+
+	sc.received_any = true;
+	sc.newest = seq;
+	sc.stats.delivered++;
+
+	auto& queue = peerChannels(_packets, peer)[channel];
+	if (_c_sequencing[channel] == sequencing::LATEST) {
+		// tombstone whatever game code has not consumed yet
+		for (size_t i = queue.first_live; i < queue.packets.size(); i++) {
+			if (queue.packets[i].data != nullptr) {
+				queue.packets[i].data = nullptr;
+				sc.stats.replaced++;
 			}
 		}
+		queue.first_live = queue.packets.size();
 	}
 
-	return count;
+	// no copy, skip the header
+	queue.packets.push_back({pk.data()+4, pk.size()-4, {}});
 }
 
-size_t ToxNetChanneled::forEachPacketPeer(peer_id peer, std::function<bool(peer_id, channel_id, uint8_t*, size_t)> fn) {
-	size_t count = 0;
+void ToxNetChanneled::setChannelReliableOverLossy(channel_id channel, bool enable) {
+	if (channel >= _channels.count || !_channels.lossless(channel)) {
+		return;
+	}
 
-	for (channel_id channel = 0; channel < 10; channel++) {
-		for (auto it = _packets[peer][channel].begin(); it != _packets[peer][channel].end();) {
-			if (fn(peer, channel, it->data(), it->size())) {
-				it = _packets[peer][channel].erase(it);
-			} else {
-				it++;
+	_c_reliable[channel] = enable;
+}
+
+void ToxNetChanneled::peer_reconnected(peer_id peer) {
+	if (_reliable.erase(peer)) {
+		SPDLOG_DEBUG("reliable channels of {} start over", peer);
+	}
+
+	// the newest seq seen is meaningless now, but keep the stats
+	if (auto seq_it = _sequenced.find(peer); seq_it != _sequenced.end()) {
+		for (auto& sc : seq_it->second) {
+			sc.send_seq = 0;
+			sc.received_any = false;
+		}
+	}
+}
+
+bool ToxNetChanneled::peer_reliable(peer_id peer, channel_id channel) const {
+	return _c_reliable[channel] && (_tox_service->friend_caps(toTox(peer)) & CAP_RELIABLE);
+}
+
+bool ToxNetChanneled::sendReliable(peer_id peer, channel_id channel, const uint8_t* data, size_t data_size) {
+	if (!peer_reachable(peer)) {
+		return false; // would never get acked
+	}
+
+	auto& rc = peerChannels(_reliable, peer)[channel];
+
+	if (rc.failed) {
+		return false;
+	}
+
+	if (_c_send_policy[channel] == send_policy::DROP && rc.unacked.size() >= reliable_window) {
+		return false; // would only queue up, behind the window
+	}
+
+	const size_t max_part = tox_max_custom_packet_size() - reliable_header_size;
+
+	const size_t parts = (data_size + max_part - 1) / max_part;
+	if (rc.unacked.size() + parts > _send_queue_max_packets) {
+		SPDLOG_WARN("reliable channel {} to {} full ({} packets)", channel, peer, rc.unacked.size());
+		return false;
+	}
+
+	// queued in full, reliable_tick() sends as the window allows
+	for (size_t offset = 0; offset < data_size;) {
+		const size_t part_size = std::min(max_part, data_size - offset);
+		const bool whole = offset == 0 && part_size == data_size;
+		const bool last = offset + part_size == data_size;
+
+		auto& u = rc.unacked.emplace_back();
+		u.seq = rc.next_seq++;
+		u.pkg.reserve(reliable_header_size + part_size);
+		u.pkg.push_back(tox_reliable_wire_id);
+		u.pkg.push_back(PKG_REL_DATA);
+		u.pkg.push_back(channel);
+		u.pkg.push_back(u.seq & 0xff);
+		u.pkg.push_back((u.seq >> 8) & 0xff);
+		u.pkg.push_back(whole ? 0 : (last ? 2 : 1));
+		u.pkg.insert(u.pkg.end(), data + offset, data + offset + part_size);
+
+		offset += part_size;
+	}
+
+	return true;
+}
+
+void ToxNetChanneled::receive_reliable(peer_id peer, PacketView& pk) {
+	if (pk.size() < 3) {
+		return;
+	}
+
+	const channel_id channel = pk[2];
+	if (channel >= _channels.count || !_c_reliable[channel]) {
+		SPDLOG_WARN("reliable packet for a channel that is not reliable");
+		return;
+	}
+
+	auto& rc = peerChannels(_reliable, peer)[channel];
+
+	if (pk[1] == PKG_REL_ACK) {
+		if (pk.size() != 3+2+4) {
+			SPDLOG_WARN("malformed reliable ack");
+			return;
+		}
+
+		const uint16_t next_expected = pk[3] | (uint16_t(pk[4]) << 8);
+		const uint32_t mask = pk[5] | (uint32_t(pk[6]) << 8) | (uint32_t(pk[7]) << 16) | (uint32_t(pk[8]) << 24);
+
+		for (auto& u : rc.unacked) {
+			const int16_t dist = static_cast<int16_t>(u.seq - next_expected);
+			if (dist < 0) {
+				u.acked = true;
+			} else if (dist >= 1 && dist <= 32 && (mask & (1u << (dist-1)))) {
+				u.acked = true;
 			}
-			count++;
 		}
+
+		while (!rc.unacked.empty() && rc.unacked.front().acked) {
+			rc.unacked.pop_front();
+		}
+		return;
 	}
 
-	return count;
+	if (pk[1] != PKG_REL_DATA || pk.size() <= reliable_header_size) {
+		SPDLOG_WARN("malformed reliable packet");
+		return;
+	}
+
+	const uint16_t seq = pk[3] | (uint16_t(pk[4]) << 8);
+	const int16_t dist = static_cast<int16_t>(seq - rc.expected);
+
+	// always ack, the last ack might be what got lost
+	rc.ack_pending = true;
+
+	if (dist < 0 || dist >= static_cast<int16_t>(reliable_window)) {
+		return; // duplicate, or way ahead
+	}
+
+	if (dist > 0) {
+		// keep for later, has to outlive the tick
+		rc.early.try_emplace(seq, pk.data() + 5, pk.data() + pk.size());
+		return;
+	}
+
+	// in order, no copy
+	reliable_deliver(peer, channel, rc, pk.data() + 5, pk.size() - 5, nullptr);
+
+	// and whatever it unblocked
+	for (auto it = rc.early.find(rc.expected); it != rc.early.end(); it = rc.early.find(rc.expected)) {
+		auto payload = std::move(it->second);
+		rc.early.erase(it);
+		reliable_deliver(peer, channel, rc, payload.data(), payload.size(), &payload);
+	}
 }
 
-size_t ToxNetChanneled::forEachPacketPeerChannel(peer_id peer, channel_id channel, std::function<bool(peer_id, channel_id, uint8_t*, size_t)> fn) {
-	size_t count = 0;
+void ToxNetChanneled::reliable_deliver(peer_id peer, channel_id channel, ReliableChannel& rc, const uint8_t* payload, size_t size, std::vector<uint8_t>* owned) {
+	rc.expected++;
+
+	const uint8_t part = payload[0];
+	const uint8_t* data = payload + 1;
+	const size_t data_size = size - 1;
+
+	auto& queue = peerChannels(_packets, peer)[channel];
 
-	for (auto it = _packets[peer][channel].begin(); it != _packets[peer][channel].end();) {
-		if (fn(peer, channel, it->data(), it->size())) {
-			it = _packets[peer][channel].erase(it);
+	if (part == 0) {
+		if (owned != nullptr) {
+			auto& new_pkg = queue.packets.emplace_back();
+			new_pkg.owned = std::move(*owned);
+			new_pkg.data = new_pkg.owned.data() + 1;
+			new_pkg.size = data_size;
 		} else {
-			it++;
+			queue.packets.push_back({const_cast<uint8_t*>(data), data_size, {}});
 		}
-		count++;
+		return;
 	}
 
-	return count;
+	if (!rc.partial_skip && rc.partial.size() + data_size > _large_max_bytes_per_peer) {
+		SPDLOG_ERROR("reliable message from {} on channel {} exceeds the limit, dropping", peer, channel);
+		rc.partial = {};
+		rc.partial_skip = true;
+	}
+
+	if (rc.partial_skip) {
+		rc.partial_skip = part != 2; // the next one is a new message
+		return;
+	}
+
+	rc.partial.insert(rc.partial.end(), data, data + data_size);
+
+	if (part == 2) {
+		auto& new_pkg = queue.packets.emplace_back();
+		new_pkg.owned = std::move(rc.partial);
+		new_pkg.data = new_pkg.owned.data();
+		new_pkg.size = new_pkg.owned.size();
+		rc.partial = {};
+	}
 }
 
-void ToxNetChanneled::clearPackets(void) {
-	_packets.clear(); // TODO: this is bad
+void ToxNetChanneled::reliable_tick(Engine&) {
+	const auto now = std::chrono::steady_clock::now();
+
+	for (auto& [peer, chans] : _reliable) {
+		const uint32_t friend_number = toTox(peer);
+
+		// retransmit timeout from the measured rtt
+		std::chrono::milliseconds rto {250};
+		if (const auto* link = _tox_service->friend_link(friend_number); link != nullptr && link->rtt_ms() > 0.f) {
+			rto = std::chrono::milliseconds(static_cast<int64_t>(link->rtt_ms() * 1.5f + 4.f * link->rtt_var_ms()));
+			rto = std::clamp(rto, std::chrono::milliseconds(50), std::chrono::milliseconds(2000));
+		}
+
+		for (channel_id channel = 0; channel < chans.size(); channel++) {
+			auto& rc = chans[channel];
+
+			if (rc.ack_pending) {
+				rc.ack_pending = false;
+
+				uint32_t mask = 0;
+				for (uint16_t i = 0; i < 32; i++) {
+					if (rc.early.count(static_cast<uint16_t>(rc.expected + 1 + i))) {
+						mask |= 1u << i;
+					}
+				}
+
+				std::array<uint8_t, 3+2+4> ack {
+					tox_reliable_wire_id,
+					PKG_REL_ACK,
+					channel,
+					uint8_t(rc.expected & 0xff), uint8_t(rc.expected >> 8),
+					uint8_t(mask & 0xff), uint8_t((mask >> 8) & 0xff), uint8_t((mask >> 16) & 0xff), uint8_t((mask >> 24) & 0xff),
+				};
+				_tox_service->friend_send_packet(friend_number, ack.data(), ack.size());
+			}
+
+			const size_t in_flight = std::min(rc.unacked.size(), reliable_window);
+			for (size_t i = 0; i < in_flight; i++) {
+				auto& u = rc.unacked[i];
+				if (u.acked) {
+					continue;
+				}
+
+				// back off on every retry
+				const auto timeout = rto * (1u << std::min<uint8_t>(u.retries, 4));
+				if (u.sent != std::chrono::steady_clock::time_point{} && now - u.sent < timeout) {
+					continue;
+				}
+
+				if (u.retries >= reliable_max_retries) {
+					// the peer drops them, most likely the channel is not reliable on its side
+					SPDLOG_ERROR("reliable channel {} to {} failed, no ack after {} retries", channel, peer, u.retries);
+					rc.failed = true;
+					rc.unacked.clear();
+					break;
+				}
+
+				if (u.sent != std::chrono::steady_clock::time_point{}) {
+					u.retries++;
+				}
+				u.sent = now;
+				_tox_service->friend_send_packet(friend_number, u.pkg.data(), u.pkg.size());
+			}
+		}
+	}
+}
+
+static constexpr size_t lossy_frag_header_size = 2+2+1+1+1+4;
+
+bool ToxNetChanneled::sendLossyLarge(peer_id peer, channel_id channel, const uint8_t* data, size_t data_size) {
+	thread_local Encoded enc;
+	if (!encode_lossy_large(channel, data, data_size, enc)) {
+		return false;
+	}
+
+	return send_encoded(peer, channel, enc);
+}
+
+bool ToxNetChanneled::encode_lossy_large(channel_id channel, const uint8_t* data, size_t data_size, Encoded& out) {
+	const size_t max_frag_size = tox_max_custom_packet_size() - lossy_frag_header_size;
+
+	const size_t data_count = (data_size + max_frag_size - 1) / max_frag_size;
+	const size_t group_size = std::min(_lossy_fec_group, data_count);
+	const size_t parity_count = group_size == 0 ? 0 : (data_count + group_size - 1) / group_size;
+	if (data_count + parity_count > 255) {
+		SPDLOG_ERROR("lossy large packet too large ({} bytes, {} fragments)", data_size, data_count + parity_count);
+		return false;
+	}
+
+	// spread evenly, the receiver derives the same from total and count
+	const size_t frag_size = (data_size + data_count - 1) / data_count;
+
+	const uint16_t msg_id = _lossy_msg_id_next++;
+
+	std::vector<uint8_t> parity(parity_count * frag_size, 0);
+
+	out.clear();
+	out.mem.reserve((data_count + parity_count) * (lossy_frag_header_size + frag_size));
+
+	auto add_frag = [&](size_t index, const uint8_t* frag, size_t size) {
+		out.mem.push_back(toxChannelByte(channel));
+		out.mem.push_back(PKG_LOSSY_FRAG);
+		out.mem.push_back(msg_id & 0xff);
+		out.mem.push_back((msg_id >> 8) & 0xff);
+		out.mem.push_back(static_cast<uint8_t>(index));
+		out.mem.push_back(static_cast<uint8_t>(data_count));
+		out.mem.push_back(static_cast<uint8_t>(group_size));
+		for (size_t i = 0; i < 4; i++) {
+			out.mem.push_back((data_size >> (i*8)) & 0xff);
+		}
+		out.mem.insert(out.mem.end(), frag, frag + size);
+		out.end_packet();
+	};
+
+	for (size_t i = 0; i < data_count; i++) {
+		const uint8_t* frag = data + i * frag_size;
+		const size_t size = std::min(frag_size, data_size - i * frag_size);
+
+		if (group_size != 0) {
+			// the short last one counts as zero padded
+			uint8_t* p = parity.data() + (i / group_size) * frag_size;
+			for (size_t j = 0; j < size; j++) {
+				p[j] ^= frag[j];
+			}
+		}
+
+		add_frag(i, frag, size);
+	}
+
+	for (size_t i = 0; i < parity_count; i++) {
+		add_frag(data_count + i, parity.data() + i * frag_size, frag_size);
+	}
+
+	return true;
+}
+
+void ToxNetChanneled::LossyReassembly::finish(void) {
+	active = false;
+	has_last = true;
+	last_msg_id = msg_id;
+	data = {};
+	parity = {};
+	have = {};
+}
+
+void ToxNetChanneled::receive_lossy_large(peer_id peer, channel_id channel, PacketView& pk) {
+	if (pk.size() <= lossy_frag_header_size) {
+		SPDLOG_WARN("malformed lossy large packet");
+		return;
+	}
+
+	const uint16_t msg_id = pk[2] | (uint16_t(pk[3]) << 8);
+	const size_t index = pk[4];
+	const size_t data_count = pk[5];
+	const size_t group_size = pk[6];
+	const size_t total = pk[7] | (size_t(pk[8]) << 8) | (size_t(pk[9]) << 16) | (size_t(pk[10]) << 24);
+
+	const size_t parity_count = group_size == 0 ? 0 : (data_count + group_size - 1) / group_size;
+	if (data_count == 0 || total == 0 || index >= data_count + parity_count) {
+		SPDLOG_WARN("malformed lossy large packet");
+		return;
+	}
+
+	auto& lpkg = peerChannels(_lossy_large_buffer, peer)[channel];
+	const auto now = std::chrono::steady_clock::now();
+
+	if (lpkg.active && now - lpkg.started > _lossy_large_deadline) {
+		SPDLOG_DEBUG("lossy large packet {} from {} missed its deadline, {}/{} fragments", lpkg.msg_id, peer, lpkg.data_have, lpkg.data_count);
+		lpkg.finish();
+	}
+
+	// wrapping compare, newer wins
+	auto newer = [](uint16_t a, uint16_t b) { return static_cast<int16_t>(a - b) > 0; };
+
+	if (lpkg.active && lpkg.msg_id != msg_id) {
+		if (!newer(msg_id, lpkg.msg_id)) {
+			return; // part of an older one
+		}
+		SPDLOG_DEBUG("lossy large packet {} from {} replaced by {}", lpkg.msg_id, peer, msg_id);
+		lpkg.finish();
+	}
+
+	if (!lpkg.active) {
+		if (lpkg.has_last && !newer(msg_id, lpkg.last_msg_id)) {
+			return; // stale, or a late fragment of something already done
+		}
+
+		// every data fragment, including the last one, has to carry at least one byte
+		const size_t frag_size = (total + data_count - 1) / data_count;
+		if (frag_size > tox_max_custom_packet_size() || total > frag_size * data_count || (data_count - 1) * frag_size >= total) {
+			SPDLOG_WARN("malformed lossy large packet");
+			return;
+		}
+
+		lpkg.active = true;
+		lpkg.msg_id = msg_id;
+		lpkg.total = total;
+		lpkg.data_count = static_cast<uint8_t>(data_count);
+		lpkg.group_size = static_cast<uint8_t>(group_size);
+		lpkg.frag_size = frag_size;
+		lpkg.data.assign(data_count * frag_size, 0); // zero padded, for the xor
+		lpkg.parity.assign(parity_count * frag_size, 0);
+		lpkg.have.assign(data_count + parity_count, 0);
+		lpkg.data_have = 0;
+		lpkg.started = now;
+	} else if (lpkg.total != total || lpkg.data_count != data_count || lpkg.group_size != group_size) {
+		SPDLOG_WARN("lossy large packet fragment does not match its message");
+		return;
+	}
+
+	if (lpkg.have[index]) {
+		return; // duplicate
+	}
+
+	const size_t size = pk.size() - lossy_frag_header_size;
+	const uint8_t* frag = pk.data() + lossy_frag_header_size;
+
+	size_t group = 0;
+	if (index < data_count) {
+		const size_t offset = index * lpkg.frag_size;
+		const size_t expected = offset < total ? std::min(lpkg.frag_size, total - offset) : 0;
+		if (size != expected) {
+			SPDLOG_WARN("lossy large packet fragment has the wrong size");
+			return;
+		}
+		std::memcpy(lpkg.data.data() + index * lpkg.frag_size, frag, size);
+		lpkg.data_have++;
+		group = group_size == 0 ? 0 : index / group_size;
+	} else {
+		if (size != lpkg.frag_size) {
+			SPDLOG_WARN("lossy large packet parity has the wrong size");
+			return;
+		}
+		group = index - data_count;
+		std::memcpy(lpkg.parity.data() + group * lpkg.frag_size, frag, size);
+	}
+	lpkg.have[index] = 1;
+
+	if (group_size != 0 && lossy_recover(lpkg, group)) {
+		SPDLOG_TRACE("recovered a lossy large packet fragment");
+	}
+
+	if (lpkg.data_have == data_count) {
+		auto& new_pkg = peerChannels(_packets, peer)[channel].packets.emplace_back();
+		new_pkg.owned = std::move(lpkg.data);
+		new_pkg.owned.resize(total); // drop the padding
+		new_pkg.data = new_pkg.owned.data();
+		new_pkg.size = new_pkg.owned.size();
+
+		lpkg.finish();
+	}
+}
+
+bool ToxNetChanneled::lossy_recover(LossyReassembly& lpkg, size_t group) {
+	const size_t data_count = lpkg.data_count;
+	const size_t first = group * lpkg.group_size;
+	const size_t last = std::min(first + lpkg.group_size, data_count);
+
+	if (!lpkg.have[data_count + group]) {
+		return false;
+	}
+
+	size_t missing = SIZE_MAX;
+	for (size_t i = first; i < last; i++) {
+		if (!lpkg.have[i]) {
+			if (missing != SIZE_MAX) {
+				return false; // more than one, can not help
+			}
+			missing = i;
+		}
+	}
+	if (missing == SIZE_MAX) {
+		return false; // nothing to do
+	}
+
+	// missing = parity ^ all others
+	uint8_t* out = lpkg.data.data() + missing * lpkg.frag_size;
+	std::memcpy(out, lpkg.parity.data() + group * lpkg.frag_size, lpkg.frag_size);
+	for (size_t i = first; i < last; i++) {
+		if (i == missing) {
+			continue;
+		}
+		const uint8_t* in = lpkg.data.data() + i * lpkg.frag_size;
+		for (size_t j = 0; j < lpkg.frag_size; j++) {
+			out[j] ^= in[j];
+		}
+	}
+
+	// the last fragment is short, keep its padding zero.
+	// (data_count-1) * frag_size < total, checked when the message started
+	if (missing == data_count - 1) {
+		const size_t size = std::min(lpkg.frag_size, lpkg.total - missing * lpkg.frag_size);
+		std::memset(out + size, 0, lpkg.frag_size - size);
+	}
+
+	lpkg.have[missing] = 1;
+	lpkg.data_have++;
+
+	return true;
+}
+
+void ToxNetChanneled::receive_large_legacy(peer_id peer, channel_id channel, PacketView& pk) {
+	auto& chans = peerChannels(_large_packets_buffer, peer);
+	auto& lpkg = chans[channel];
+
+	const bool last = pk[1] == PKG_LEGACY_LARGE_LAST;
+
+	if (lpkg.legacy && lpkg.skip) {
+		// rejected, the rest of it goes too
+		lpkg.skip = !last;
+		return;
+	}
+
+	if (lpkg.total != 0 && !lpkg.legacy) {
+		abort_large(peer, channel, lpkg, "abandoned");
+	}
+
+	if (lpkg.total == 0) {
+		// new message, the size is only known at the end
+		lpkg.msg_id = 0;
+		lpkg.received = 0;
+		lpkg.skip = false;
+		lpkg.legacy = true;
+		lpkg.compressed = false;
+		lpkg.streaming = false;
+	}
+
+	const uint8_t* part = pk.data() + 2;
+	const size_t part_size = pk.size() - 2;
+
+	size_t peer_bytes = part_size;
+	for (const auto& other : chans) {
+		if (!other.streaming) {
+			peer_bytes += other.total;
+		}
+	}
+	if (peer_bytes > _large_max_bytes_per_peer) {
+		SPDLOG_ERROR("large packet from {} exceeds the limit, dropping", peer);
+		abort_large(peer, channel, lpkg, nullptr);
+		lpkg.skip = !last;
+		return;
+	}
+
+	lpkg.last = std::chrono::steady_clock::now();
+	lpkg.data.insert(lpkg.data.end(), part, part + part_size);
+	lpkg.received += part_size;
+	lpkg.total = lpkg.received;
+
+	if (last) {
+		auto& new_pkg = peerChannels(_packets, peer)[channel].packets.emplace_back();
+		new_pkg.owned = std::move(lpkg.data);
+		new_pkg.data = new_pkg.owned.data();
+		new_pkg.size = new_pkg.owned.size();
+
+		lpkg.total = 0;
+		lpkg.received = 0;
+		lpkg.data = {};
+	}
+}
+
+void ToxNetChanneled::abort_large(peer_id peer, channel_id channel, LargeReassembly& lpkg, const char* reason) {
+	if (reason != nullptr) {
+		SPDLOG_WARN("large packet {} from {} {}, {}/{} bytes", lpkg.msg_id, peer, reason, lpkg.received, lpkg.total);
+	}
+
+	if (lpkg.streaming && _large_stream_fns[channel]) {
+		_large_stream_fns[channel](LargeStreamPart{
+			peer, channel, lpkg.msg_id,
+			nullptr, 0,
+			lpkg.received, lpkg.total,
+			false, true
+		});
+	}
+
+	lpkg.total = 0;
+	lpkg.received = 0;
+	lpkg.data = {}; // frees
+}
+
+void ToxNetChanneled::reclaim_large_packets(void) {
+	const auto now = std::chrono::steady_clock::now();
+	if (now - _large_reclaim_last < std::chrono::seconds(1)) {
+		return;
+	}
+	_large_reclaim_last = now;
+
+	for (auto it = _large_packets_buffer.begin(); it != _large_packets_buffer.end();) {
+		const auto* f = _tox_service->_tox_friends.find(toTox(it->first));
+		const bool gone = !_peer_list.count(it->first) || f == nullptr || f->connection_status == TOX_CONNECTION_NONE;
+
+		for (channel_id channel = 0; channel < it->second.size(); channel++) {
+			auto& lpkg = it->second[channel];
+			if (lpkg.total == 0) {
+				continue;
+			}
+
+			if (gone) {
+				// whatever was in flight will never complete
+				abort_large(it->first, channel, lpkg, "lost, peer gone");
+			} else if (now - lpkg.last > _large_timeout) {
+				abort_large(it->first, channel, lpkg, "timed out");
+			}
+		}
+
+		if (gone) {
+			it = _large_packets_buffer.erase(it);
+		} else {
+			it++;
+		}
+	}
+
+	// queued sends would never leave
+	for (auto it = _send_queue.begin(); it != _send_queue.end();) {
+		if (!peer_reachable(it->first)) {
+			it = _send_queue.erase(it);
+		} else {
+			it++;
+		}
+	}
+
+	for (auto it = _batch_buffer.begin(); it != _batch_buffer.end();) {
+		if (!peer_reachable(it->first)) {
+			it = _batch_buffer.erase(it);
+		} else {
+			it++;
+		}
+	}
+
+	for (auto it = _lossy_buckets.begin(); it != _lossy_buckets.end();) {
+		if (!_peer_list.count(it->first)) {
+			it = _lossy_buckets.erase(it);
+		} else {
+			it++;
+		}
+	}
+
+	for (auto it = _sequenced.begin(); it != _sequenced.end();) {
+		if (!_peer_list.count(it->first)) {
+			it = _sequenced.erase(it);
+		} else {
+			it++;
+		}
+	}
+
+	for (auto it = _reliable.begin(); it != _reliable.end();) {
+		if (!_peer_list.count(it->first)) {
+			it = _reliable.erase(it); // both sides start over
+		} else {
+			it++;
+		}
+	}
+
+	for (auto it = _peer_generation.begin(); it != _peer_generation.end();) {
+		if (!_peer_list.count(it->first)) {
+			it = _peer_generation.erase(it);
+		} else {
+			it++;
+		}
+	}
+
+	for (auto it = _lossy_large_buffer.begin(); it != _lossy_large_buffer.end();) {
+		if (!_peer_list.count(it->first)) {
+			it = _lossy_large_buffer.erase(it);
+			continue;
+		}
+
+		for (auto& lpkg : it->second) {
+			if (lpkg.active && now - lpkg.started > _lossy_large_deadline) {
+				lpkg.finish();
+			}
+		}
+
+		it++;
+	}
+}
+
+void ToxNetChanneled::retain_packets(Engine&) {
+	// only what the game did not consume this tick
+	for (auto& [peer, ch_data] : _packets) {
+		for (auto& ch_q : ch_data) {
+			ch_q.compact();
+
+			for (auto& pkg : ch_q.packets) {
+				if (pkg.owned.empty()) {
+					pkg.owned.assign(pkg.data, pkg.data + pkg.size);
+					pkg.data = pkg.owned.data();
+				}
+			}
+		}
+	}
+}
+
+void ToxNetChanneled::setLargeStreamHandler(channel_id channel, large_stream_fn fn) {
+	if (channel >= _channels.count) {
+		return;
+	}
+
+	// a message already in progress keeps its mode
+	_large_stream_fns[channel] = std::move(fn);
+}
+
+bool ToxNetChanneled::getLargeProgress(peer_id peer, channel_id channel, size_t& received, size_t& total) const {
+	auto peer_it = _large_packets_buffer.find(peer);
+	if (peer_it == _large_packets_buffer.end() || channel >= peer_it->second.size()) {
+		return false;
+	}
+
+	const auto& lpkg = peer_it->second[channel];
+	if (lpkg.total == 0) {
+		return false;
+	}
+
+	received = lpkg.received;
+	total = lpkg.total;
+	return true;
+}
+
+uint8_t* ToxNetChanneled::getSendBuffer(void) {
+	// outgoing packets get assembled here, the headers go in front of the payload
+	thread_local std::vector<uint8_t> scratch(send_headroom + tox_max_custom_packet_size());
+	return scratch.data() + send_headroom;
+}
+
+bool ToxNetChanneled::sendPacketV(peer_id peer, channel_id channel, const SendBuffer* buffers, size_t buffer_count) {
+	if (!buffers) return false;
+
+	size_t data_size = 0;
+	for (size_t i = 0; i < buffer_count; i++) {
+		data_size += buffers[i].size;
+	}
+	if (data_size > getMaxPacketSize()) {
+		SPDLOG_ERROR("packet too large ({} bytes), use sendPacketLarge()", data_size);
+		return false;
+	}
+
+	uint8_t* payload = getSendBuffer();
+	for (size_t i = 0, offset = 0; i < buffer_count; offset += buffers[i].size, i++) {
+		if (buffers[i].data != payload + offset) {
+			std::memmove(payload + offset, buffers[i].data, buffers[i].size);
+		}
+	}
+
+	return sendPacket(peer, channel, payload, data_size);
+}
+
+bool ToxNetChanneled::sendPacket(peer_id peer, channel_id channel, const uint8_t* data, size_t data_size) {
+	if (channel >= _channels.count) return false;
+	if (!data) return false;
+	if (data_size < 1) return false;
+
+	if (peer_reliable(peer, channel)) {
+		return sendReliable(peer, channel, data, data_size);
+	}
+
+	if (_c_sequencing[channel] == sequencing::NONE && _c_compression[channel].enabled) { // compressed, if it helps
+		thread_local std::vector<uint8_t> new_data;
+		new_data.clear();
+		new_data.push_back(toxChannelByte(channel));
+		new_data.push_back(PKG_SMALL_LZ);
+		if (compress_payload(peer, channel, data, data_size, new_data) && new_data.size() <= tox_max_custom_packet_size()) {
+			if (!flush_batch(peer, channel)) {
+				return false; // would overtake the batch
+			}
+			return sendRaw(peer, channel, new_data.data(), new_data.size());
+		}
+	}
+
+	if (data_size > getMaxPacketSize()) {
+		SPDLOG_ERROR("packet too large ({} bytes), use sendPacketLarge()", data_size);
+		return false;
+	}
+
+	// one copy, right behind the header
+	uint8_t* payload = getSendBuffer();
+	if (payload != data) {
+		std::memmove(payload, data, data_size);
+	}
+
+	return send_framed(peer, channel, payload, data_size);
+}
+
+bool ToxNetChanneled::send_framed(peer_id peer, channel_id channel, uint8_t* payload, size_t payload_size) {
+	// peers from before MM_HELLO would take the seq for payload, they get unsequenced packets
+	if (_c_sequencing[channel] != sequencing::NONE && peer_new_framing(peer)) {
+		auto& sc = peerChannels(_sequenced, peer)[channel];
+
+		uint8_t* pkg = payload - 4;
+		pkg[0] = toxChannelByte(channel);
+		pkg[1] = PKG_SEQUENCED;
+		pkg[2] = sc.send_seq & 0xff;
+		pkg[3] = (sc.send_seq >> 8) & 0xff;
+
+		// a dropped send still uses up the seq, the receiver does not care about gaps
+		sc.send_seq++;
+
+		return sendRaw(peer, channel, pkg, 4 + payload_size);
+	}
+
+	if (_batching && 2 + 2 + payload_size <= tox_max_custom_packet_size() && (_tox_service->friend_caps(toTox(peer)) & CAP_BATCH)) {
+		return batch_packet(peer, channel, payload, payload_size);
+	}
+
+	// anything batched on this channel goes first, to keep the order
+	if (!flush_batch(peer, channel)) {
+		return false;
+	}
+
+	// map to tox channels, not a large packet
+	uint8_t* pkg = payload - 2;
+	pkg[0] = toxChannelByte(channel);
+	pkg[1] = PKG_SMALL;
+
+	return sendRaw(peer, channel, pkg, 2 + payload_size);
+}
+
+bool ToxNetChanneled::sendRaw(peer_id peer, channel_id channel, uint8_t* data, size_t data_size) {
+	if (_channels.lossless(channel)) {
+		if (_c_send_policy[channel] == send_policy::DROP && sendq_backlog(peer, channel)) {
+			return false; // would only queue up
+		}
+
+		if (!send_queue_room(peer, 1)) {
+			return false;
+		}
+
+		// the scheduler sends it
+		return peerChannels(_send_queue, peer)[channel].packets.push(data, data_size);
+	} else {
+		if (_lossy_throttle && !lossy_bucket_take(peer, data_size)) {
+			return false; // over budget, dropping is what lossy is for
+		}
+		return _tox_service->friend_send_packet(toTox(peer), data, data_size);
+	}
+}
+
+bool ToxNetChanneled::lossy_bucket_take(peer_id peer, size_t bytes) {
+	const auto now = std::chrono::steady_clock::now();
+	const float budget = static_cast<float>(_tox_service->friend_send_budget(toTox(peer))); // bytes/s
+
+	// allow bursts of up to 100ms, but always at least one full packet
+	const float burst = std::max(budget / 10.f, static_cast<float>(tox_max_custom_packet_size()));
+
+	auto& bucket = _lossy_buckets[peer];
+	if (bucket.last == std::chrono::steady_clock::time_point{}) {
+		bucket.tokens = burst;
+	} else {
+		bucket.tokens += budget * std::chrono::duration<float>(now - bucket.last).count();
+	}
+	bucket.last = now;
+
+	bucket.tokens = std::min(bucket.tokens, burst);
+
+	if (bucket.tokens < bytes) {
+		return false;
+	}
+
+	bucket.tokens -= bytes;
+	return true;
+}
+
+bool ToxNetChanneled::sendq_backlog(peer_id peer, channel_id channel) const {
+	if (_tox_service->friend_sendq_size(toTox(peer)) != 0) {
+		return true;
+	}
+
+	auto peer_it = _send_queue.find(peer);
+	return peer_it != _send_queue.end() && !peer_it->second[channel].packets.empty();
+}
+
+bool ToxNetChanneled::send_queue_room(peer_id peer, size_t packets) const {
+	if (!peer_reachable(peer)) {
+		return false;
+	}
+
+	size_t queued = 0;
+	if (auto peer_it = _send_queue.find(peer); peer_it != _send_queue.end()) {
+		for (const auto& ch_q : peer_it->second) {
+			queued += ch_q.packets.size();
+		}
+	}
+
+	if (queued + packets > _send_queue_max_packets) {
+		SPDLOG_WARN("send queue for {} full ({} packets)", peer, queued);
+		return false;
+	}
+
+	return true;
+}
+
+bool ToxNetChanneled::batch_packet(peer_id peer, channel_id channel, const uint8_t* data, size_t data_size) {
+	if (_channels.lossless(channel)) {
+		if (_c_send_policy[channel] == send_policy::DROP && sendq_backlog(peer, channel)) {
+			return false; // would only queue up
+		}
+	}
+
+	auto& buffer = peerChannels(_batch_buffer, peer)[channel];
+
+	// full, send what we have and start a new one
+	if (buffer.size() + 2 + data_size > tox_max_custom_packet_size()) {
+		if (!flush_batch(peer, channel, buffer) && !buffer.empty()) {
+			return false; // kept for retry, no room
+		}
+	}
+
+	if (buffer.empty()) {
+		buffer.push_back(toxChannelByte(channel));
+		buffer.push_back(PKG_BATCH);
+	}
+
+	buffer.push_back(data_size & 0xff);
+	buffer.push_back((data_size >> 8) & 0xff);
+	buffer.insert(buffer.end(), data, data + data_size);
+
+	return true;
+}
+
+bool ToxNetChanneled::flush_batch(peer_id peer, channel_id channel, std::vector<uint8_t>& buffer) {
+	if (buffer.empty()) {
+		return true;
+	}
+
+	const bool succ = sendRaw(peer, channel, buffer.data(), buffer.size());
+	if (!succ) {
+		if (_channels.lossless(channel) && _c_send_policy[channel] == send_policy::BLOCK) {
+			return false; // try again later, flush_batches() or the next send
+		}
+		SPDLOG_ERROR("failed to send batch of {} bytes", buffer.size());
+	}
+
+	buffer.clear(); // keeps the memory
+	return succ;
+}
+
+bool ToxNetChanneled::flush_batch(peer_id peer, channel_id channel) {
+	auto peer_it = _batch_buffer.find(peer);
+	if (peer_it == _batch_buffer.end()) {
+		return true;
+	}
+
+	return flush_batch(peer, channel, peer_it->second[channel]);
+}
+
+void ToxNetChanneled::flush_batches(Engine&) {
+	for (auto& [peer, ch_buffers] : _batch_buffer) {
+		for (channel_id channel = 0; channel < ch_buffers.size(); channel++) {
+			flush_batch(peer, channel, ch_buffers[channel]);
+		}
+	}
+}
+
+bool ToxNetChanneled::sendPacketLarge(peer_id peer, channel_id channel, const uint8_t* data, size_t data_size) {
+	if (channel >= _channels.count) return false;
+	if (!data) return false;
+	if (data_size < 1) return false;
+
+	if (data_size <= getMaxPacketSize()) {
+		return sendPacket(peer, channel, data, data_size);
+	}
+
+	const bool new_framing = peer_new_framing(peer);
+
+	if (!_channels.lossless(channel)) {
+		if (!new_framing) {
+			SPDLOG_ERROR("peer {} does not support large lossy packets", peer);
+			return false;
+		}
+		return sendLossyLarge(peer, channel, data, data_size);
+	}
+
+	if (peer_reliable(peer, channel)) {
+		return sendReliable(peer, channel, data, data_size);
+	}
+
+	if (_c_send_policy[channel] == send_policy::DROP && sendq_backlog(peer, channel)) {
+		return false;
+	}
+
+	// anything batched on this channel goes first, to keep the order
+	if (!flush_batch(peer, channel)) {
+		return false;
+	}
+
+	if (!new_framing) {
+		return send_large_legacy(peer, channel, data, data_size);
+	}
+
+	if (data_size > UINT32_MAX) {
+		SPDLOG_ERROR("large packet too large ({} bytes)", data_size);
+		return false;
+	}
+
+	// compressed, the fragments carry the compressed payload
+	uint8_t first_type = PKG_LARGE_FIRST;
+	std::vector<uint8_t> packed;
+	if (compress_payload(peer, channel, data, data_size, packed)) {
+		if (2 + packed.size() <= tox_max_custom_packet_size()) {
+			// fits in one
+			packed.insert(packed.begin(), {toxChannelByte(channel), PKG_SMALL_LZ});
+			return sendRaw(peer, channel, packed.data(), packed.size());
+		}
+
+		first_type = PKG_LARGE_FIRST_LZ;
+		data = packed.data();
+		data_size = packed.size();
+	}
+
+	// all parts are queued here, the scheduler feeds them to toxcore as there is room,
+	// so a large packet is never sent half way
+	const size_t first_data_size = tox_max_custom_packet_size() - (2+2+4);
+	const size_t part_data_size = tox_max_custom_packet_size() - (2+2);
+	const size_t parts = data_size <= first_data_size ? 1 : 1 + (data_size - first_data_size + part_data_size - 1) / part_data_size;
+	if (!send_queue_room(peer, parts)) {
+		return false;
+	}
+
+	auto& queue = peerChannels(_send_queue, peer)[channel].packets;
+
+	const uint16_t msg_id = _large_msg_id_next++;
+
+	for (size_t remaining_data_size = data_size; remaining_data_size > 0;) {
+		const bool first = remaining_data_size == data_size;
+
+		// lossless channels, a large packet
+		std::array<uint8_t, 2+2+4> header {
+			toxChannelByte(channel),
+			first ? first_type : uint8_t(PKG_LARGE_PART),
+			uint8_t(msg_id & 0xff),
+			uint8_t((msg_id >> 8) & 0xff),
+		};
+		size_t header_size = 2+2;
+		if (first) {
+			for (size_t i = 0; i < 4; i++) {
+				header[header_size++] = (data_size >> (i*8)) & 0xff;
+			}
+		}
+
+		const size_t data_this_pk = std::min(remaining_data_size, tox_max_custom_packet_size() - header_size);
+
+		// header and data straight into the queue slot
+		queue.push(header.data(), header_size, data + (data_size - remaining_data_size), data_this_pk);
+
+		remaining_data_size -= data_this_pk;
+	}
+
+	return true;
+}
+
+bool ToxNetChanneled::send_large_legacy(peer_id peer, channel_id channel, const uint8_t* data, size_t data_size) {
+	// no msg id or size, all parts queued at once like the new framing
+	const size_t part_data_size = tox_max_custom_packet_size() - 2;
+	const size_t parts = (data_size + part_data_size - 1) / part_data_size;
+	if (!send_queue_room(peer, parts)) {
+		return false;
+	}
+
+	auto& queue = peerChannels(_send_queue, peer)[channel].packets;
+
+	for (size_t offset = 0; offset < data_size;) {
+		const size_t data_this_pk = std::min(data_size - offset, part_data_size);
+		const bool last = offset + data_this_pk == data_size;
+
+		const std::array<uint8_t, 2> header {
+			toxChannelByte(channel),
+			last ? uint8_t(PKG_LEGACY_LARGE_LAST) : uint8_t(PKG_LEGACY_LARGE_PART),
+		};
+		queue.push(header.data(), header.size(), data + offset, data_this_pk);
+
+		offset += data_this_pk;
+	}
+
+	return true;
+}
+
+bool ToxNetChanneled::encode(channel_id channel, const uint8_t* data, size_t data_size, bool compressed, bool with_dict, Encoded& out) {
+	out.clear();
+
+	if (compressed) {
+		thread_local std::vector<uint8_t> packed;
+		packed.clear();
+		if (!compress_payload(channel, data, data_size, with_dict, packed)) {
+			return false;
+		}
+
+		if (2 + packed.size() <= tox_max_custom_packet_size()) {
+			out.mem.push_back(toxChannelByte(channel));
+			out.mem.push_back(PKG_SMALL_LZ);
+			out.mem.insert(out.mem.end(), packed.begin(), packed.end());
+			out.end_packet();
+			return true;
+		}
+
+		if (!_channels.lossless(channel)) {
+			return false; // lossy large ones go raw
+		}
+
+		return encode_large(channel, packed.data(), packed.size(), PKG_LARGE_FIRST_LZ, out);
+	}
+
+	if (data_size <= getMaxPacketSize()) {
+		out.mem.push_back(toxChannelByte(channel));
+		out.mem.push_back(PKG_SMALL);
+		out.mem.insert(out.mem.end(), data, data + data_size);
+		out.end_packet();
+		return true;
+	}
+
+	if (!_channels.lossless(channel)) {
+		return encode_lossy_large(channel, data, data_size, out);
+	}
+
+	return encode_large(channel, data, data_size, PKG_LARGE_FIRST, out);
+}
+
+bool ToxNetChanneled::encode_large(channel_id channel, const uint8_t* data, size_t data_size, uint8_t first_type, Encoded& out) {
+	if (data_size > UINT32_MAX) {
+		SPDLOG_ERROR("large packet too large ({} bytes)", data_size);
+		return false;
+	}
+
+	const uint16_t msg_id = _large_msg_id_next++;
+
+	for (size_t offset = 0; offset < data_size;) {
+		const bool first = offset == 0;
+
+		out.mem.push_back(toxChannelByte(channel));
+		out.mem.push_back(first ? first_type : uint8_t(PKG_LARGE_PART));
+		out.mem.push_back(msg_id & 0xff);
+		out.mem.push_back((msg_id >> 8) & 0xff);
+		if (first) {
+			for (size_t i = 0; i < 4; i++) {
+				out.mem.push_back((data_size >> (i*8)) & 0xff);
+			}
+		}
+
+		const size_t data_this_pk = std::min<size_t>(data_size - offset, tox_max_custom_packet_size() - (first ? 2+2+4 : 2+2));
+		out.mem.insert(out.mem.end(), data + offset, data + offset + data_this_pk);
+		out.end_packet();
+
+		offset += data_this_pk;
+	}
+
+	return true;
+}
+
+bool ToxNetChanneled::send_encoded(peer_id peer, channel_id channel, Encoded& enc) {
+	if (_channels.lossless(channel)) {
+		if (_c_send_policy[channel] == send_policy::DROP && sendq_backlog(peer, channel)) {
+			return false; // would only queue up
+		}
+
+		// anything batched on this channel goes first, to keep the order
+		if (!flush_batch(peer, channel)) {
+			return false;
+		}
+
+		// all or nothing, so a large packet is never sent half way
+		if (!send_queue_room(peer, enc.ends.size())) {
+			return false;
+		}
+
+		// a part the queue would refuse fails the whole thing, before anything is queued
+		for (size_t i = 0, begin = 0; i < enc.ends.size(); begin = enc.ends[i], i++) {
+			if (enc.ends[i] == begin || enc.ends[i] - begin > tox_max_custom_packet_size()) {
+				SPDLOG_ERROR("encoded packet for {} on channel {} has a part of {} bytes", peer, channel, enc.ends[i] - begin);
+				return false;
+			}
+		}
+
+		auto& queue = peerChannels(_send_queue, peer)[channel].packets;
+		bool succ = true;
+		for (size_t i = 0, begin = 0; i < enc.ends.size(); begin = enc.ends[i], i++) {
+			succ &= queue.push(enc.mem.data() + begin, enc.ends[i] - begin);
+		}
+		return succ;
+	}
+
+	// lossy, lost ones are what the parity is for
+	bool succ = true;
+	for (size_t i = 0, begin = 0; i < enc.ends.size(); begin = enc.ends[i], i++) {
+		succ &= sendRaw(peer, channel, enc.mem.data() + begin, enc.ends[i] - begin);
+	}
+	return succ;
+}
+
+bool ToxNetChanneled::peer_reachable(peer_id peer) const {
+	const auto* f = _tox_service->_tox_friends.find(toTox(peer));
+	return f != nullptr && f->connection_status != TOX_CONNECTION_NONE && f->mm_instance;
+}
+
+ToxNetChanneled::BroadcastResult ToxNetChanneled::broadcastPacket(const std::vector<peer_id>& peers, channel_id channel, const uint8_t* data, size_t data_size) {
+	BroadcastResult res;
+
+	const bool valid = channel < _channels.count && data != nullptr && data_size > 0;
+
+	// per peer state, nothing to share
+	const bool one_by_one = valid && (_c_reliable[channel] || _c_sequencing[channel] != sequencing::NONE);
+
+	// framed once, each only if needed. compressed without and with the dictionaries
+	thread_local Encoded enc_raw;
+	thread_local std::array<Encoded, 2> enc_lz;
+	bool enc_raw_done = false;
+	bool enc_raw_ok = false;
+	std::array<bool, 2> enc_lz_done {};
+	std::array<bool, 2> enc_lz_ok {};
+
+	for (const peer_id peer : peers) {
+		if (!peer_reachable(peer)) {
+			res.skipped.push_back(peer);
+			continue;
+		}
+
+		bool succ = false;
+		if (!valid) {
+			succ = false;
+		} else if (one_by_one || (!peer_new_framing(peer) && data_size > getMaxPacketSize())) {
+			// per peer state, or a large packet in the old framing
+			succ = sendPacketLarge(peer, channel, data, data_size);
+		} else {
+			const bool lz = _c_compression[channel].enabled && (_tox_service->friend_caps(toTox(peer)) & CAP_LZ);
+			const size_t dict = lz && peer_lz_dict(peer) ? 1 : 0;
+
+			if (lz && !enc_lz_done[dict]) {
+				enc_lz_done[dict] = true;
+				enc_lz_ok[dict] = encode(channel, data, data_size, true, dict == 1, enc_lz[dict]);
+			}
+
+			if (lz && enc_lz_ok[dict]) {
+				succ = send_encoded(peer, channel, enc_lz[dict]);
+			} else {
+				// not compressible, or an old peer
+				if (!enc_raw_done) {
+					enc_raw_done = true;
+					enc_raw_ok = encode(channel, data, data_size, false, false, enc_raw);
+				}
+				succ = enc_raw_ok && send_encoded(peer, channel, enc_raw);
+			}
+		}
+
+		if (succ) {
+			res.sent++;
+		} else {
+			res.failed.push_back(peer);
+		}
+	}
+
+	return res;
+}
+
+ToxNetChanneled::BroadcastResult ToxNetChanneled::broadcastPacket(channel_id channel, const uint8_t* data, size_t data_size) {
+	thread_local std::vector<peer_id> peers;
+	peers.clear();
+	for (const peer_id peer : _peer_list) {
+		if (peer_reachable(peer)) {
+			peers.push_back(peer);
+		}
+	}
+
+	return broadcastPacket(peers, channel, data, data_size);
+}
+
+void ToxNetChanneled::setChannelSendPolicy(channel_id channel, send_policy policy) {
+	if (channel >= _channels.count) {
+		return;
+	}
+
+	_c_send_policy[channel] = policy;
+}
+
+void ToxNetChanneled::setChannelPriority(channel_id channel, uint8_t priority, uint8_t weight) {
+	if (channel >= _channels.count) {
+		return;
+	}
+
+	_c_schedule[channel].priority = priority;
+	_c_schedule[channel].weight = std::max<uint8_t>(weight, 1);
+}
+
+size_t ToxNetChanneled::getSendQueueSize(peer_id peer) const {
+	size_t count = _tox_service ? _tox_service->friend_sendq_size(toTox(peer)) : 0;
+
+	if (auto peer_it = _send_queue.find(peer); peer_it != _send_queue.end()) {
+		for (const auto& ch_q : peer_it->second) {
+			count += ch_q.packets.size();
+		}
+	}
+
+	return count;
+}
+
+void ToxNetChanneled::send_scheduled(Engine&) {
+	for (auto& [peer, queues] : _send_queue) {
+		size_t budget = _send_budget == 0 ? SIZE_MAX : _send_budget;
+		schedule_peer(peer, queues, budget);
+
+		// a burst does not get to keep its memory
+		for (auto& ch_q : queues) {
+			ch_q.packets.shrink(send_queue_keep_slots);
+		}
+	}
+}
+
+bool ToxNetChanneled::schedule_peer(peer_id peer, std::vector<SendQueue>& queues, size_t& budget) {
+	const uint32_t friend_number = toTox(peer);
+
+	// whatever toxcore could not take yet has to go first
+	if (_tox_service->friend_sendq_size(friend_number) != 0) {
+		return false;
+	}
+
+	// channels, highest priority first
+	std::array<channel_id, tox_max_channels> order;
+	const size_t order_size = queues.size();
+	for (size_t i = 0; i < order_size; i++) {
+		order[i] = static_cast<channel_id>(i);
+	}
+	std::stable_sort(order.begin(), order.begin() + order_size, [this](channel_id a, channel_id b) {
+		return _c_schedule[a].priority > _c_schedule[b].priority;
+	});
+
+	const size_t quantum = tox_max_custom_packet_size();
+
+	for (size_t level_begin = 0; level_begin < order_size;) {
+		size_t level_end = level_begin + 1;
+		while (level_end < order_size && _c_schedule[order[level_end]].priority == _c_schedule[order[level_begin]].priority) {
+			level_end++;
+		}
+
+		// deficit round robin within the level, until it is empty
+		bool level_has_packets = true;
+		while (level_has_packets) {
+			level_has_packets = false;
+
+			for (size_t i = level_begin; i < level_end; i++) {
+				const channel_id channel = order[i];
+				auto& ch_q = queues[channel];
+				if (ch_q.packets.empty()) {
+					ch_q.deficit = 0; // no saving up while idle
+					continue;
+				}
+
+				ch_q.deficit += quantum * _c_schedule[channel].weight;
+
+				while (!ch_q.packets.empty() && ch_q.packets[0].size() <= ch_q.deficit) {
+					const auto pkg = ch_q.packets[0];
+					if (pkg.size() > budget) {
+						return false; // next tick
+					}
+
+					// ToxService would refuse it, keep it here instead of losing a part of a large packet
+					if (_tox_service->friend_sendq_space(friend_number) == 0) {
+						return false;
+					}
+
+					if (!_tox_service->friend_send_packet_lossless(friend_number, pkg.data(), pkg.size())) {
+						// not a full queue, it will not get better
+						SPDLOG_ERROR("failed to send packet to {} on channel {}", peer, channel);
+					}
+
+					ch_q.deficit -= pkg.size();
+					budget -= pkg.size();
+					ch_q.packets.pop_front();
+
+					// toxcore is full, the rest waits here, where it can still be overtaken
+					if (_tox_service->friend_sendq_size(friend_number) != 0) {
+						return false;
+					}
+				}
+
+				if (!ch_q.packets.empty()) {
+					level_has_packets = true;
+				}
+			}
+		}
+
+		level_begin = level_end;
+	}
+
+	return true;
+}
+
+size_t ToxNetChanneled::getSendQueueHighWater(peer_id peer) const {
+	return _tox_service ? _tox_service->friend_sendq_high_water(toTox(peer)) : 0;
+}
+
+size_t ToxNetChanneled::forEachPacket(std::function<bool(peer_id, channel_id, uint8_t*, size_t)> fn) {
+	size_t count = 0;
+	for (auto&[peer, ch_data] : _packets) {
+		for (channel_id channel = 0; channel < ch_data.size(); channel++) {
+			count += ch_data[channel].consume(peer, channel, fn);
+		}
+	}
+
+	return count;
+}
+
+size_t ToxNetChanneled::forEachPacketPeer(peer_id peer, std::function<bool(peer_id, channel_id, uint8_t*, size_t)> fn) {
+	// dont create entries for unknown peers
+	auto peer_it = _packets.find(peer);
+	if (peer_it == _packets.end()) {
+		return 0;
+	}
+
+	size_t count = 0;
+	for (channel_id channel = 0; channel < peer_it->second.size(); channel++) {
+		count += peer_it->second[channel].consume(peer, channel, fn);
+	}
+
+	return count;
+}
+
+size_t ToxNetChanneled::forEachPacketPeerChannel(peer_id peer, channel_id channel, std::function<bool(peer_id, channel_id, uint8_t*, size_t)> fn) {
+	if (channel >= _channels.count) {
+		return 0;
+	}
+
+	// dont create entries for unknown peers
+	auto peer_it = _packets.find(peer);
+	if (peer_it == _packets.end()) {
+		return 0;
+	}
+
+	return peer_it->second[channel].consume(peer, channel, fn);
+}
+
+void ToxNetChanneled::clearPackets(void) {
+	// keep the queues (and their memory) around
+	for (auto& [peer, ch_data] : _packets) {
+		for (auto& ch_q : ch_data) {
+			ch_q.packets.clear();
+			ch_q.first_live = 0;
+		}
+	}
 }
 
 } // MM::Tox::Services
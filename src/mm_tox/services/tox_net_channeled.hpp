@@ -3,10 +3,14 @@
 #include <mm/services/net_channeled_interface.hpp>
 
 #include <mm_tox/services/tox_service.hpp>
+#include <mm_tox/services/tox_channeled_framing.hpp>
+#include <mm_tox/utils/channel_table.hpp>
 
 #include <vector>
+#include <deque>
 #include <map>
 #include <array>
+#include <chrono>
 
 namespace MM::Tox::Services {
 
@@ -18,7 +22,12 @@ class ToxNetChanneled : public MM::Services::NetChanneledInterface {
 	// service stuff
 	public:
 		ToxNetChanneled(void) {}
-		ToxNetChanneled(std::array<channel_type, 10>& c_types) : _c_type_arr{c_types} {}
+		// same wire ids as before ToxChannels (161+channel, 192+channel), so mixed layouts stay compatible with old peers
+		ToxNetChanneled(std::array<channel_type, 10>& c_types);
+		// checked at compile time, eg ToxNetChanneled{ToxChannels<channel_type::LOSSY, channel_type::LOSSLESS>{}}.
+		// lossless and lossy channels are numbered separately, peers have to use the same layout
+		template<channel_type... Types>
+		explicit ToxNetChanneled(ToxChannels<Types...>) : _channels{ToxChannels<Types...>::table} {}
 
 		const char* name(void) override { return "ToxNetServiceChanneled"; }
 
@@ -28,31 +37,158 @@ class ToxNetChanneled : public MM::Services::NetChanneledInterface {
 	protected:
 		void pull_fresh_packages(Engine& engine);
 
+		// copies packets still queued out of ToxService's buffers, before they get reused
+		void retain_packets(Engine& engine);
+
+		// sends out whatever got batched this tick
+		void flush_batches(Engine& engine);
+
+		// hands queued lossless packets to ToxService, by priority and weight, within the byte budget
+		void send_scheduled(Engine& engine);
+
 
 	// netservice stuff
 	protected:
-		// wether a channel_id is lossy or not
-		std::array<channel_type, 10> _c_type_arr {
-			channel_type::LOSSLESS,
-			channel_type::LOSSLESS,
-			channel_type::LOSSLESS,
-			channel_type::LOSSLESS,
-			channel_type::LOSSLESS,
-			channel_type::LOSSLESS,
-			channel_type::LOSSLESS,
-			channel_type::LOSSLESS,
-			channel_type::LOSSLESS,
-			channel_type::LOSSLESS,
+		using default_channels = ToxChanneledDefaultChannels;
+
+		// channel types and their wire ids
+		ToxChannelTable _channels {default_channels::table};
+
+		// per channel state for a peer, sized to _channels.count on first use
+		template<typename T>
+		std::vector<T>& peerChannels(std::map<peer_id, std::vector<T>>& per_peer, peer_id peer) {
+			return toxPeerChannels(per_peer, peer, _channels.count);
+		}
+
+	public:
+		// what to do with lossless packets, when toxcore's send queue is full
+		enum class send_policy {
+			BLOCK, // queue in ToxService until toxcore takes it (default)
+			DROP, // fail right away, the caller may send something newer later
+		};
+
+	protected:
+		std::array<send_policy, tox_max_channels> _c_send_policy {}; // BLOCK
+
+		// the wire format, see tox_channeled_framing.hpp
+		using ChannelQueue = ToxChanneledQueue;
+		using LargeReassembly = ToxLargeReassembly;
+
+		std::map<peer_id, std::vector<ChannelQueue>> _packets;
+		std::map<peer_id, std::vector<LargeReassembly>> _large_packets_buffer;
+
+		// reassembly memory limit per peer, larger packets get dropped
+		size_t _large_max_bytes_per_peer {64*1024*1024};
+		// incomplete large packets are freed after this long without a new part
+		std::chrono::steady_clock::duration _large_timeout {std::chrono::seconds(30)};
+		std::chrono::steady_clock::time_point _large_reclaim_last {};
+
+		uint16_t _large_msg_id_next {0};
+
+		void receive_large(peer_id peer, channel_id channel, PacketView& pk);
+		// framing 0, PKG_LEGACY_LARGE_PART and PKG_LEGACY_LARGE_LAST
+		void receive_large_legacy(peer_id peer, channel_id channel, PacketView& pk);
+
+		// large packets over lossy channels: fragments, plus one xor parity fragment per _lossy_fec_group fragments.
+		// any one lost fragment per group can be rebuilt. only the newest message per channel is assembled,
+		// older ones and those not complete within _lossy_large_deadline are dropped
+		struct LossyReassembly {
+			bool active {false};
+			uint16_t msg_id {0};
+			bool has_last {false};
+			uint16_t last_msg_id {0}; // newest finished or dropped, anything older is stale
+
+			size_t total {0};
+			uint8_t data_count {0};
+			uint8_t group_size {0}; // 0 for no parity
+			size_t frag_size {0};
+
+			std::vector<uint8_t> data; // data_count * frag_size
+			std::vector<uint8_t> parity; // one frag_size per group
+			std::vector<uint8_t> have; // per fragment, data then parity
+			size_t data_have {0};
+
+			std::chrono::steady_clock::time_point started {};
+
+			void finish(void); // drops the buffers, remembers msg_id
+		};
+		std::map<peer_id, std::vector<LossyReassembly>> _lossy_large_buffer;
+
+		size_t _lossy_fec_group {4}; // data fragments per parity fragment, 0 for none
+		std::chrono::steady_clock::duration _lossy_large_deadline {std::chrono::milliseconds(500)};
+		uint16_t _lossy_msg_id_next {0};
+
+		bool sendLossyLarge(peer_id peer, channel_id channel, const uint8_t* data, size_t data_size);
+		void receive_lossy_large(peer_id peer, channel_id channel, PacketView& pk);
+		// rebuilds a missing data fragment of group, if possible
+		static bool lossy_recover(LossyReassembly& lpkg, size_t group);
+		// logs (if reason), tells the stream handler and resets
+		void abort_large(peer_id peer, channel_id channel, LargeReassembly& lpkg, const char* reason);
+		// frees timed out reassemblies and those of peers that are gone, once per second
+		void reclaim_large_packets(void);
+
+		// opt-in, small packets get packed into one tox packet per peer and channel, sent at the end of the tick
+		bool _batching {false};
+		std::map<peer_id, std::vector<std::vector<uint8_t>>> _batch_buffer; // header + (size, data)...
+
+		static void unpack_batch(ChannelQueue& queue, PacketView& pk);
+		bool batch_packet(peer_id peer, channel_id channel, const uint8_t* data, size_t data_size);
+		// on failure, a lossless (BLOCK) batch is kept for the next try, anything behind it has to wait
+		bool flush_batch(peer_id peer, channel_id channel, std::vector<uint8_t>& buffer);
+		bool flush_batch(peer_id peer, channel_id channel); // if any
+
+		// outgoing lossless packets, already framed, waiting for the scheduler
+		struct SendQueue {
+			PacketRing packets {tox_max_custom_packet_size()}; // slots get reused, no allocation per packet
+			size_t deficit {0}; // bytes this channel may still send this round (deficit round robin)
+		};
+		std::map<peer_id, std::vector<SendQueue>> _send_queue;
+		// per peer, all channels combined (and per reliable channel). beyond that, sends fail instead of piling up.
+		// ~5.5MiB, also the largest lossless large packet
+		size_t _send_queue_max_packets {1u << 12};
+		// drained queues keep at most this many slots
+		static constexpr size_t send_queue_keep_slots = 64;
+
+		struct ChannelSchedule {
+			uint8_t priority {0}; // higher goes first, lower ones only get what is left
+			uint8_t weight {1}; // share between channels of the same priority
 		};
+		std::array<ChannelSchedule, tox_max_channels> _c_schedule {};
+
+		// per peer and tick, 0 for no limit
+		size_t _send_budget {64*1024};
+
+		// false if the peer is blocked (toxcore is backed up) or the budget is used up
+		bool schedule_peer(peer_id peer, std::vector<SendQueue>& queues, size_t& budget);
+		bool sendq_backlog(peer_id peer, channel_id channel) const;
+		// false for offline or unknown peers (they would never leave the queue), or if packets more do not fit
+		bool send_queue_room(peer_id peer, size_t packets) const;
+
+		// opt-in, lossy packets beyond ToxService::friend_send_budget() get dropped
+		bool _lossy_throttle {false};
+		struct LossyBucket {
+			float tokens {0.f}; // bytes
+			std::chrono::steady_clock::time_point last {};
+		};
+		std::map<peer_id, LossyBucket> _lossy_buckets;
+
+		bool lossy_bucket_take(peer_id peer, size_t bytes);
+
+		// channel byte for the wire
+		uint8_t toxChannelByte(channel_id channel) const { return _channels.wire_id[channel]; }
+		// data is copied (lossless) or sent right away (lossy)
+		bool sendRaw(peer_id peer, channel_id channel, uint8_t* data, size_t data_size);
 
-		std::map<peer_id, std::array<std::vector<std::vector<uint8_t>>, 10>> _packets;
-		std::map<peer_id, std::array<std::vector<uint8_t>, 10>> _large_packets_buffer; // for lossless
+		// payload is in the send scratch buffer, with send_headroom bytes in front of it for the header
+		static constexpr size_t send_headroom = 4;
+		bool send_framed(peer_id peer, channel_id channel, uint8_t* payload, size_t payload_size);
 
 	public:
 		channel_id getMaxChannels(void) override {
 			// lossy The first byte of data must be in the range 192-254.
 			// lossless The first byte of data must be in the range 69, 160-191.
-			return 10; // TODO: arbitrary, but those 10 channels can be of the same type
+			// see ToxChannelTable for how channels map to those
+			return static_cast<channel_id>(_channels.count);
 		}
 
 		bool getSupportedChannelType(channel_type) override { return true; } // both types are supported
@@ -64,12 +200,262 @@ class ToxNetChanneled : public MM::Services::NetChanneledInterface {
 		bool sendPacket(peer_id peer, channel_id channel, const uint8_t* data, size_t data_size) override;
 		bool sendPacketLarge(peer_id peer, channel_id channel, const uint8_t* data, size_t data_size) override;
 
+		// scatter-gather, the buffers are sent as one packet of at most getMaxPacketSize() bytes
+		struct SendBuffer {
+			const uint8_t* data;
+			size_t size;
+		};
+		bool sendPacketV(peer_id peer, channel_id channel, const SendBuffer* buffers, size_t buffer_count);
+
+		// serialize straight into the transport: write up to getMaxPacketSize() bytes, then sendPacketBuffer().
+		// the buffer is per thread, and only valid until the next send on that thread
+		uint8_t* getSendBuffer(void);
+		bool sendPacketBuffer(peer_id peer, channel_id channel, size_t data_size) { return sendPacket(peer, channel, getSendBuffer(), data_size); }
+
 		size_t forEachPacket(std::function<bool(peer_id, channel_id, uint8_t*, size_t)> fn) override;
 		size_t forEachPacketPeer(peer_id peer, std::function<bool(peer_id, channel_id, uint8_t*, size_t)> fn) override;
 		size_t forEachPacketPeerChannel(peer_id peer, channel_id channel, std::function<bool(peer_id, channel_id, uint8_t*, size_t)> fn) override;
 
 		void clearPackets(void) override;
 
+	protected: // fan-out
+		// a message framed once, as sent to any peer
+		struct Encoded {
+			std::vector<uint8_t> mem; // all packets back to back
+			std::vector<size_t> ends; // end of each packet in mem
+
+			void clear(void) { mem.clear(); ends.clear(); }
+			void end_packet(void) { ends.push_back(mem.size()); }
+		};
+
+		bool encode(channel_id channel, const uint8_t* data, size_t data_size, bool compressed, bool with_dict, Encoded& out);
+		bool encode_large(channel_id channel, const uint8_t* data, size_t data_size, uint8_t first_type, Encoded& out);
+		bool encode_lossy_large(channel_id channel, const uint8_t* data, size_t data_size, Encoded& out);
+		bool send_encoded(peer_id peer, channel_id channel, Encoded& enc);
+		// framing 0, for peers without MM_HELLO
+		bool send_large_legacy(peer_id peer, channel_id channel, const uint8_t* data, size_t data_size);
+
+		// connected, and a MushMachine instance
+		bool peer_reachable(peer_id peer) const;
+		// announced MM_TOX_FRAMING_VERSION >= 1, older peers only understand small and legacy large packets
+		bool peer_new_framing(peer_id peer) const { return _tox_service->friend_framing_version(toTox(peer)) >= 1; }
+
+	public: // fan-out
+		struct BroadcastResult {
+			size_t sent {0};
+			std::vector<peer_id> skipped; // offline or not a MushMachine instance
+			std::vector<peer_id> failed;
+		};
+
+		// like sendPacketLarge(), but the packets are framed (and compressed) once for all peers.
+		// channels with per peer state (reliable, sequenced) fall back to sending one by one
+		BroadcastResult broadcastPacket(const std::vector<peer_id>& peers, channel_id channel, const uint8_t* data, size_t data_size);
+		// to all connected MushMachine peers in the peer list
+		BroadcastResult broadcastPacket(channel_id channel, const uint8_t* data, size_t data_size);
+
+	public: // batching
+		void setBatching(bool enable) { _batching = enable; }
+		bool getBatching(void) const { return _batching; }
+
+	public: // rate control
+		void setLossyThrottle(bool enable) { _lossy_throttle = enable; }
+		bool getLossyThrottle(void) const { return _lossy_throttle; }
+
+	protected: // reliable over lossy
+		// own sequence numbers, selective acks and retransmits per channel,
+		// so a loss only stalls that channel, instead of every lossless channel of the peer
+		struct ReliableChannel {
+			// sending
+			uint16_t next_seq {0};
+			struct Unacked {
+				uint16_t seq {0};
+				bool acked {false}; // selectively, waits for the ones before it
+				uint8_t retries {0};
+				std::chrono::steady_clock::time_point sent {}; // never sent if default
+				std::vector<uint8_t> pkg; // framed
+			};
+			std::deque<Unacked> unacked; // in seq order, only the first reliable_window are in flight
+			bool failed {false}; // gave up retransmitting, sends fail until the peer reconnects
+
+			// receiving
+			uint16_t expected {0};
+			std::map<uint16_t, std::vector<uint8_t>> early; // out of order, part byte + data
+			std::vector<uint8_t> partial; // message made of parts, so far
+			bool partial_skip {false}; // over _large_max_bytes_per_peer, drop parts until the last one
+			bool ack_pending {false};
+		};
+		std::map<peer_id, std::vector<ReliableChannel>> _reliable;
+		std::array<bool, tox_max_channels> _c_reliable {};
+
+		static constexpr size_t reliable_window = 256;
+		static constexpr size_t reliable_header_size = 2+1+2+1;
+		// a packet not acked after this many retransmits fails the channel (peer did not enable it)
+		static constexpr uint8_t reliable_max_retries = 10;
+
+		// the channel is reliable on our side and the peer announced CAP_RELIABLE.
+		// otherwise the channel goes over toxcore's lossless packets as usual
+		bool peer_reliable(peer_id peer, channel_id channel) const;
+		bool sendReliable(peer_id peer, channel_id channel, const uint8_t* data, size_t data_size);
+		void receive_reliable(peer_id peer, PacketView& pk);
+		// delivers one in order payload (part byte + data)
+		void reliable_deliver(peer_id peer, channel_id channel, ReliableChannel& rc, const uint8_t* payload, size_t size, std::vector<uint8_t>* owned);
+		// acks and retransmits
+		void reliable_tick(Engine& engine);
+
+		// ToxFriend::connection_generation last seen, per peer state from before a reconnect is stale
+		std::map<peer_id, uint32_t> _peer_generation;
+		// the remote might have restarted, its seqs start over (reliable and sequenced)
+		void peer_reconnected(peer_id peer);
+
+	public:
+		// lossy channels only, see setChannelSequenced()
+		enum class sequencing {
+			NONE, // arrival order (default)
+			SEQUENCED, // drop anything older than the newest delivered
+			LATEST, // like SEQUENCED, but only the newest undelivered packet is kept
+		};
+
+		struct SequencedStats {
+			uint64_t delivered {0};
+			uint64_t stale {0}; // arrived after a newer one, dropped
+			uint64_t duplicates {0}; // same seq as the newest, dropped
+			uint64_t replaced {0}; // LATEST only, delivered but superseded before consumed
+		};
+
+	protected: // sequenced lossy
+		struct SequencedChannel {
+			uint16_t send_seq {0};
+
+			bool received_any {false};
+			uint16_t newest {0};
+			SequencedStats stats;
+		};
+		std::map<peer_id, std::vector<SequencedChannel>> _sequenced;
+		std::array<sequencing, tox_max_channels> _c_sequencing {}; // NONE
+
+		void receive_sequenced(peer_id peer, channel_id channel, PacketView& pk);
+
+	public: // sequenced lossy
+		// lossy channels only, both sides need the same setting.
+		// the sender stamps each packet with a 16 bit seq, so reordered old state can not overwrite newer state.
+		// large packets on the channel are not sequenced, neither is anything sent to peers without framing 1
+		void setChannelSequenced(channel_id channel, sequencing mode);
+
+		// false if nothing was received on the channel yet
+		bool getSequencedStats(peer_id peer, channel_id channel, SequencedStats& stats) const;
+
+	protected: // compression
+		struct Compression {
+			bool enabled {false};
+			size_t min_size {64}; // smaller packets go raw
+			std::vector<uint8_t> dict; // optional, only used with peers that announce the same _lz_dict_id
+		};
+		std::array<Compression, tox_max_channels> _c_compression {};
+
+		// hash over all channel dictionaries, announced with MM_HELLO, 0 for none
+		uint32_t _lz_dict_id {0};
+		void update_lz_dict_id(void);
+		// the peer has the exact same dictionaries
+		bool peer_lz_dict(peer_id peer) const;
+
+		static constexpr size_t lz_header_size = 1+4;
+
+		// appends flags, raw size and the compressed data to out.
+		// false (and out unchanged) if the channel or peer does not do compression, or it would not be smaller
+		bool compress_payload(peer_id peer, channel_id channel, const uint8_t* data, size_t data_size, std::vector<uint8_t>& out);
+		// same, without looking at the peer. the channel dictionary is only used if use_dict
+		bool compress_payload(channel_id channel, const uint8_t* data, size_t data_size, bool use_dict, std::vector<uint8_t>& out);
+		// data starts at the flags
+		bool decompress_payload(peer_id peer, channel_id channel, const uint8_t* data, size_t data_size, std::vector<uint8_t>& out);
+		void receive_compressed(peer_id peer, channel_id channel, PacketView& pk);
+
+	public: // compression
+		// small packets and lossless large packets, not reliable, sequenced or lossy large ones.
+		// only used towards peers that announced CAP_LZ, others keep getting raw packets
+		void setChannelCompression(channel_id channel, bool enable, size_t min_size = 64);
+		// mostly helps small packets (eg. typical packets concatenated).
+		// only used towards peers with the exact same dictionaries on all channels, others get compression without
+		void setChannelCompressionDict(channel_id channel, std::vector<uint8_t> dict);
+
+	public: // reliable over lossy
+		// lossless channels only, both sides need the same setting.
+		// the channel is carried over lossy packets with its own acks, instead of toxcore's shared lossless stream.
+		// peers without CAP_RELIABLE get normal lossless packets. if the peer never acks, the channel fails for it until it reconnects
+		void setChannelReliableOverLossy(channel_id channel, bool enable);
+
+	public: // large packets
+		void setLargeMaxBytesPerPeer(size_t bytes) { _large_max_bytes_per_peer = bytes; }
+		void setLargeTimeout(std::chrono::steady_clock::duration timeout) { _large_timeout = timeout; }
+
+		// large packets on lossy channels, see LossyReassembly
+		void setLossyFecGroup(size_t data_fragments_per_parity) { _lossy_fec_group = std::min<size_t>(data_fragments_per_parity, 255); }
+		void setLossyLargeDeadline(std::chrono::steady_clock::duration deadline) { _lossy_large_deadline = deadline; }
+
+		// one part of a large packet, as it arrives (in order)
+		struct LargeStreamPart {
+			peer_id peer;
+			channel_id channel;
+			uint16_t msg_id;
+
+			const uint8_t* data; // only valid during the call
+			size_t size;
+
+			size_t offset; // of data in the whole message, offset+size is the progress
+			size_t total;
+
+			bool last; // message complete with this part
+			bool aborted; // message will not complete (timeout, peer gone, ...), no data
+		};
+		// return false to cancel, the rest of that message is dropped
+		using large_stream_fn = std::function<bool(const LargeStreamPart&)>;
+
+		// large packets on this channel go to fn part by part, instead of being buffered and handed to forEachPacket*().
+		// pass an empty fn to go back to buffering
+		void setLargeStreamHandler(channel_id channel, large_stream_fn fn);
+
+		// of the large packet currently arriving, false if none
+		bool getLargeProgress(peer_id peer, channel_id channel, size_t& received, size_t& total) const;
+
+	protected:
+		std::array<large_stream_fn, tox_max_channels> _large_stream_fns {};
+
+	public: // send queue
+		void setChannelSendPolicy(channel_id channel, send_policy policy);
+
+		// lossless only, lossy packets are sent right away
+		void setChannelPriority(channel_id channel, uint8_t priority, uint8_t weight = 1);
+
+		// bytes per peer and tick handed to toxcore, 0 for no limit
+		void setSendBudget(size_t bytes_per_tick) { _send_budget = bytes_per_tick; }
+		size_t getSendBudget(void) const { return _send_budget; }
+
+		// packets per peer waiting in the scheduler, all channels combined. also the unacked limit of reliable channels.
+		// large packets are queued in full, so this also limits their size (packets * getMaxPacketSize())
+		void setSendQueueMaxPackets(size_t packets) { _send_queue_max_packets = packets; }
+
+		// lossless packets queued for a peer, in the scheduler and in ToxService (see ToxService::friend_sendq_size())
+		size_t getSendQueueSize(peer_id peer) const;
+		size_t getSendQueueHighWater(peer_id peer) const;
+
+	public: // link
+		// rtt, jitter, loss and clock offset, see ToxService::friend_link(), nullptr if unknown
+		const LinkEstimator* getPeerLink(peer_id peer) const { return _tox_service ? _tox_service->friend_link(toTox(peer)) : nullptr; }
+
+		// a local wall clock time (ms since the unix epoch) in the peer's clock, for netcode time sync.
+		// returns the input, if there is no estimate (yet)
+		int64_t toPeerTime(peer_id peer, int64_t local_ms) const {
+			const auto* link = getPeerLink(peer);
+			if (link == nullptr || !link->clock_synced()) {
+				return local_ms;
+			}
+			return local_ms + static_cast<int64_t>(link->clock_offset_ms());
+		}
+
+	public: // peers
+		// eg. from ToxLobby, only packets from peers in the list are received
+		void addPeer(peer_id peer) { _peer_list.insert(peer); }
+		void removePeer(peer_id peer) { _peer_list.erase(peer); }
+
 	public: // tox utilities
 		peer_id toNet(const uint32_t tox_friend_number) const { return tox_friend_number; }
 		uint32_t toTox(const peer_id peer) const { return peer; }
@@ -3,9 +3,11 @@
 #include <entt/core/hashed_string.hpp>
 
 #include <mm/services/filesystem.hpp>
+#include <physfs.h> // PHYSFS_delete(), FilesystemService can not delete
 
 #include <sodium/utils.h>
 #include <tox.h>
+#include <tox_events.h>
 
 #include <random>
 #include <optional>
@@ -14,6 +16,9 @@
 #include <utility>
 #include <vector>
 #include <array>
+#include <algorithm>
+#include <tuple>
+#include <chrono>
 #include <cstring>
 #include <cassert>
 
@@ -28,6 +33,15 @@
 //#define LOGTOXCB(x) LOG_TRACE("[ToxCallBack] {}", x)
 #define LOGTOXCB(x) LOG_INFO("[ToxCallBack] {}", x)
 
+// only set while tox_events_iterate() runs (worker thread or batched tick).
+// tox_events_iterate() passes its own state as user_data, so the ngc callbacks (not covered by tox_events) use this instead
+static thread_local MM::Tox::Services::ToxService* __tls_recording_ts = nullptr;
+
+using ToxGroupEvent = MM::Tox::Services::ToxService::ToxGroupEvent;
+
+// while recording, ngc callbacks only record the event, iterate() applies them on the tick
+#define DEFER_NGC(...) if (__tls_recording_ts) { __tls_recording_ts->record_group_event(ToxGroupEvent{__VA_ARGS__}); return; }
+
 // ============ tox callbacks ============
 
 // logging
@@ -128,7 +142,7 @@ static void setup_tox_callbacks(Tox* tox) {
 	CALLBACK_REG(group_message);
 	CALLBACK_REG(group_private_message);
 	CALLBACK_REG(group_custom_packet);
-	CALLBACK_REG(group_custom_packet);
+	CALLBACK_REG(group_custom_private_packet);
 	CALLBACK_REG(group_invite);
 	CALLBACK_REG(group_peer_join);
 	CALLBACK_REG(group_peer_exit);
@@ -139,24 +153,172 @@ static void setup_tox_callbacks(Tox* tox) {
 #undef CALLBACK_REG
 }
 
+// feeds a tox_events batch into the same callbacks tox_iterate() would call
+// NOTE: custom packets and friend connection status are applied grouped by ToxService::apply_events()
+static void dispatch_tox_events(Tox* tox, const Tox_Events* events, void* user_data) {
+#define DISPATCH(x, ...) \
+	for (uint32_t i = 0; i < tox_events_get_##x##_size(events); i++) { \
+		const auto* e = tox_events_get_##x(events, i); \
+		x##_cb(tox, __VA_ARGS__, user_data); \
+	}
+#define G(x, f) tox_event_##x##_get_##f(e)
+
+	DISPATCH(self_connection_status, G(self_connection_status, connection_status));
+
+	DISPATCH(friend_name, G(friend_name, friend_number), G(friend_name, name), G(friend_name, name_length));
+	DISPATCH(friend_status_message, G(friend_status_message, friend_number), G(friend_status_message, message), G(friend_status_message, message_length));
+	DISPATCH(friend_status, G(friend_status, friend_number), G(friend_status, status));
+	DISPATCH(friend_typing, G(friend_typing, friend_number), G(friend_typing, typing));
+	DISPATCH(friend_read_receipt, G(friend_read_receipt, friend_number), G(friend_read_receipt, message_id));
+	DISPATCH(friend_request, G(friend_request, public_key), G(friend_request, message), G(friend_request, message_length));
+	DISPATCH(friend_message, G(friend_message, friend_number), G(friend_message, type), G(friend_message, message), G(friend_message, message_length));
+
+	DISPATCH(file_recv_control, G(file_recv_control, friend_number), G(file_recv_control, file_number), G(file_recv_control, control));
+	DISPATCH(file_chunk_request, G(file_chunk_request, friend_number), G(file_chunk_request, file_number), G(file_chunk_request, position), G(file_chunk_request, length));
+	DISPATCH(file_recv, G(file_recv, friend_number), G(file_recv, file_number), G(file_recv, kind), G(file_recv, file_size), G(file_recv, filename), G(file_recv, filename_length));
+	DISPATCH(file_recv_chunk, G(file_recv_chunk, friend_number), G(file_recv_chunk, file_number), G(file_recv_chunk, position), G(file_recv_chunk, data), G(file_recv_chunk, length));
+
+	DISPATCH(conference_invite, G(conference_invite, friend_number), G(conference_invite, type), G(conference_invite, cookie), G(conference_invite, cookie_length));
+	DISPATCH(conference_connected, G(conference_connected, conference_number));
+	DISPATCH(conference_message, G(conference_message, conference_number), G(conference_message, peer_number), G(conference_message, type), G(conference_message, message), G(conference_message, message_length));
+	DISPATCH(conference_title, G(conference_title, conference_number), G(conference_title, peer_number), G(conference_title, title), G(conference_title, title_length));
+	DISPATCH(conference_peer_name, G(conference_peer_name, conference_number), G(conference_peer_name, peer_number), G(conference_peer_name, name), G(conference_peer_name, name_length));
+	DISPATCH(conference_peer_list_changed, G(conference_peer_list_changed, conference_number));
+
+#undef G
+#undef DISPATCH
+}
+
+static void log_custom_packet_error(Tox_Err_Friend_Custom_Packet err_f_send) {
+	if (err_f_send == Tox_Err_Friend_Custom_Packet::TOX_ERR_FRIEND_CUSTOM_PACKET_EMPTY) {
+		LOG_ERROR("sending packet to friend failed: " "EMPTY");
+	} else if (err_f_send == Tox_Err_Friend_Custom_Packet::TOX_ERR_FRIEND_CUSTOM_PACKET_TOO_LONG) {
+		LOG_ERROR("sending packet to friend failed: " "TOO_LONG");
+	} else if (err_f_send == Tox_Err_Friend_Custom_Packet::TOX_ERR_FRIEND_CUSTOM_PACKET_FRIEND_NOT_CONNECTED) {
+		LOG_ERROR("sending packet to friend failed: " "FRIEND_NOT_CONNECTED");
+	} else if (err_f_send == Tox_Err_Friend_Custom_Packet::TOX_ERR_FRIEND_CUSTOM_PACKET_NULL) {
+		LOG_ERROR("sending packet to friend failed: " "NULL");
+	} else if (err_f_send == Tox_Err_Friend_Custom_Packet::TOX_ERR_FRIEND_CUSTOM_PACKET_SENDQ) {
+		LOG_ERROR("sending packet to friend failed: " "SENDQ");
+	} else if (err_f_send == Tox_Err_Friend_Custom_Packet::TOX_ERR_FRIEND_CUSTOM_PACKET_INVALID) {
+		LOG_ERROR("sending packet to friend failed: " "INVALID");
+	} else if (err_f_send == Tox_Err_Friend_Custom_Packet::TOX_ERR_FRIEND_CUSTOM_PACKET_FRIEND_NOT_FOUND) {
+		LOG_ERROR("sending packet to friend failed: " "FRIEND_NOT_FOUND");
+	}
+}
+
 namespace MM::Tox::Services {
 
+// savefile
+// physfs can not rename, so the save can not be replaced atomically. instead the new save is written
+// to ".tmp" first, the old one copied to ".bak", and only then the real one overwritten.
+// closing a physfs write handle flushes it to disk (fsync on posix), so at any point in time one of them is complete.
+// ".tmp" is deleted once the real one is written, so it only exists if that did not finish.
+// read_savefile() tells which one to load.
+static bool write_file(const MM::Services::FilesystemService& fs, const std::string& path, const uint8_t* data, size_t size) {
+	auto file = fs.open(path.c_str(), MM::Services::FilesystemService::FOPEN_t::WRITE);
+	if (!file) {
+		LOG_ERROR("failed to open '{}' for writing", path);
+		return false;
+	}
+
+	const bool succ = fs.write(file, data, size) == static_cast<int64_t>(size);
+	fs.close(file); // on disk after this
+	if (!succ) {
+		LOG_ERROR("failed to write '{}'", path);
+	}
+
+	return succ;
+}
+
+static bool read_file(const MM::Services::FilesystemService& fs, const std::string& path, std::vector<uint8_t>& out) {
+	out.clear();
+	if (!fs.exists(path.c_str())) {
+		return false;
+	}
+
+	auto file = fs.open(path.c_str());
+	if (!file) {
+		return false;
+	}
+
+	out.resize(fs.length(file));
+	const bool succ = fs.read(file, out.data(), out.size()) == static_cast<int64_t>(out.size());
+	fs.close(file);
+
+	return succ;
+}
+
+static bool write_savefile(const MM::Services::FilesystemService& fs, const std::string& path, const uint8_t* data, size_t size) {
+	if (!fs.exists(path.c_str())) {
+		// nothing to lose yet
+		return write_file(fs, path, data, size);
+	}
+
+	// left over, the last write did not finish, so the real one might be cut off. the old ".bak" is still good
+	const bool unfinished = fs.exists((path + ".tmp").c_str());
+
+	if (!write_file(fs, path + ".tmp", data, size)) {
+		return false;
+	}
+
+	// one rolling backup of the previous save
+	if (std::vector<uint8_t> old; !unfinished && read_file(fs, path, old) && !old.empty()) {
+		if (!write_file(fs, path + ".bak", old.data(), old.size())) {
+			LOG_WARN("failed to back up '{}'", path);
+		}
+	}
+
+	if (!write_file(fs, path, data, size)) {
+		return false;
+	}
+
+	if (PHYSFS_delete((path + ".tmp").c_str()) == 0) {
+		LOG_WARN("failed to remove '{}.tmp'", path);
+	}
+
+	return true;
+}
+
+// empty out if there is no save
+static void read_savefile(const MM::Services::FilesystemService& fs, const std::string& path, std::vector<uint8_t>& out) {
+	read_file(fs, path, out);
+
+	// only there if the last write did not finish
+	std::vector<uint8_t> tmp;
+	if (read_file(fs, path + ".tmp", tmp) && !tmp.empty()) {
+		// died while writing the real one: it is cut off (or empty), the tmp one is the complete new save.
+		// died while writing the tmp one: the real one is still the complete old save
+		// (a complete save is never the start of another, it ends with tox's end section)
+		if (out.size() < tmp.size() && std::equal(out.cbegin(), out.cend(), tmp.cbegin())) {
+			LOG_WARN("toxsave was cut off, loading '{}.tmp'", path);
+			out.swap(tmp);
+			return;
+		}
+	}
+
+	if (out.empty() && read_file(fs, path + ".bak", out) && !out.empty()) {
+		LOG_WARN("toxsave missing or empty, loading '{}.bak'", path);
+	}
+}
+// savefile end
+
 // internal pkg
 constexpr size_t __internal_pkg_MMInstance_size = 8u;
-bool __internal_pkg_MMInstance_is_magic_correct(uint8_t* data) {
-	static constexpr uint8_t magic_num_value_ref[8] {
-		0x83u,
-		0xafu,
-		0x33u,
-		0x31u,
-		0x70u,
-		0x62u,
-		0x33u,
-		0x88u,
-	};
-
-	for (size_t i = 0; i < 8; i++) {
-		if (data[i] != magic_num_value_ref[i]) {
+static constexpr uint8_t __internal_pkg_MMInstance_magic[__internal_pkg_MMInstance_size] {
+	0x83u,
+	0xafu,
+	0x33u,
+	0x31u,
+	0x70u,
+	0x62u,
+	0x33u,
+	0x88u,
+};
+
+bool __internal_pkg_MMInstance_is_magic_correct(const uint8_t* data) {
+	for (size_t i = 0; i < __internal_pkg_MMInstance_size; i++) {
+		if (data[i] != __internal_pkg_MMInstance_magic[i]) {
 			return false;
 		}
 	}
@@ -165,13 +327,31 @@ bool __internal_pkg_MMInstance_is_magic_correct(uint8_t* data) {
 }
 
 constexpr size_t __internal_pkg_MMApp_size = 254u;
+
+constexpr size_t __internal_pkg_MMHello_app_max = 255u;
+
+static void __internal_pkg_MMHello_put(std::vector<uint8_t>& pkg, ToxHelloType type, uint64_t value, size_t size) {
+	pkg.push_back(type);
+	pkg.push_back(static_cast<uint8_t>(size));
+	for (size_t i = 0; i < size; i++) {
+		pkg.push_back((value >> (i*8)) & 0xff);
+	}
+}
+
+static uint32_t __internal_pkg_MMHello_get(const uint8_t* data, size_t size) {
+	uint32_t value = 0;
+	for (size_t i = 0; i < size; i++) {
+		value |= uint32_t(data[i]) << (i*8);
+	}
+	return value;
+}
 // internal pkg end
 
 ToxService::ToxService(void) {
 	MM::Logger::initSectionLogger("MM::Tox");
 }
 
-ToxService::ToxService(Engine& engine, const std::string& path_to_toxsave) {
+ToxService::ToxService(Engine& engine, const std::string& path_to_toxsave, bool threaded) : _threaded(threaded) {
 	MM::Logger::initSectionLogger("MM::Tox");
 
 	auto& fs = engine.getService<MM::Services::FilesystemService>();
@@ -215,16 +395,14 @@ bool ToxService::enable(Engine& engine, std::vector<UpdateStrategies::TaskInfo>&
 	tox_options_set_udp_enabled(options, true);
 	tox_options_set_hole_punching_enabled(options, true);
 
+	// the worker iterates, while the tick still calls into tox (send message, savedata, ...)
+	tox_options_set_experimental_thread_safety(options, _threaded);
+
 	std::vector<uint8_t> save_file_mem;
 	// if no path, no persistence
 	if (!_path_to_toxsave.empty()) {
-		auto file = fs.open(_path_to_toxsave.c_str());
-		if (file) {
-			auto file_length = fs.length(file);
-			save_file_mem.resize(file_length);
-			fs.read(file, save_file_mem.data(), save_file_mem.size());
-			fs.close(file);
-
+		read_savefile(fs, _path_to_toxsave, save_file_mem);
+		if (!save_file_mem.empty()) {
 			options->savedata_type = TOX_SAVEDATA_TYPE_TOX_SAVE;
 			options->savedata_data = save_file_mem.data();
 			options->savedata_length = save_file_mem.size();
@@ -252,6 +430,10 @@ bool ToxService::enable(Engine& engine, std::vector<UpdateStrategies::TaskInfo>&
 	}
 
 	setup_tox_callbacks(_tox);
+	if (events_batched()) {
+		// replaces all callbacks tox_events knows about, ngc ones stay
+		tox_events_init(_tox);
+	}
 
 	// dht bootstrap
 	{ // TODO: use file, and nodes.tox.chat/json
@@ -322,7 +504,8 @@ bool ToxService::enable(Engine& engine, std::vector<UpdateStrategies::TaskInfo>&
 		// TODO: propper error checking
 		for (uint32_t friend_number : friend_list) {
 			TOX_ERR_FRIEND_QUERY err_f_query;
-			auto& f = _tox_friends[friend_number];
+			friend_mark_active(friend_number); // hot part, defaults are fine, but needs to send its state
+			auto& f = _tox_friends_info[friend_number];
 
 			// dep
 			//f.connection_status = tox_friend_get_connection_status(_tox, friend_number, &err_f_query);
@@ -405,7 +588,19 @@ bool ToxService::enable(Engine& engine, std::vector<UpdateStrategies::TaskInfo>&
 		}
 	}
 
+	if (!_path_to_toxsave.empty()) {
+		// physfs is thread safe, the service outlives us
+		_save_writer = std::make_unique<SaveWriter>([&fs, path = _path_to_toxsave](const uint8_t* data, size_t size) {
+			return write_savefile(fs, path, data, size);
+		});
+	}
+
 	update_savefile(engine);
+	_save_last = std::chrono::steady_clock::now();
+
+	if (_threaded) {
+		thread_start();
+	}
 
 	// setup tasks
 	task_array.push_back(
@@ -423,7 +618,11 @@ bool ToxService::enable(Engine& engine, std::vector<UpdateStrategies::TaskInfo>&
 }
 
 void ToxService::disable(Engine& engine) {
+	thread_stop();
+
 	update_savefile(engine);
+	_save_writer.reset(); // blocks until written
+	_state_dirty = false;
 
 	tox_kill(_tox);
 	_tox = nullptr;
@@ -431,128 +630,543 @@ void ToxService::disable(Engine& engine) {
 
 
 void ToxService::iterate(Engine& engine) {
-	tox_iterate(_tox, this);
+	if (_threaded) {
+		// the worker does the iterating, apply what it collected since last tick
+		thread_drain();
+	} else if (_batched_events) {
+		__tls_recording_ts = this;
+		Tox_Err_Events_Iterate err_e_it = TOX_ERR_EVENTS_ITERATE_OK;
+		Tox_Events* events = tox_events_iterate(_tox, false, &err_e_it);
+		__tls_recording_ts = nullptr;
+
+		if (err_e_it != TOX_ERR_EVENTS_ITERATE_OK) {
+			LOG_ERROR("tox_events_iterate failed with error code {}", err_e_it);
+		}
+
+		// null if nothing happend
+		if (events != nullptr) {
+			apply_events(events);
+			tox_events_free(events);
+		}
+		apply_group_events(_group_events_recording);
+	} else {
+		tox_iterate(_tox, this);
+	}
+
+	// toxcore might have room again
+	sendq_flush();
 
 	// process some internal pkgs and send if dirty
-	for (auto&& it : _tox_friends) {
+	// only friends that had traffic or changed state this tick
+	for (const uint32_t f_id : _tox_friends_active) {
+		auto& f = _tox_friends.at(f_id);
+
+		link_handle_internal(f_id, f);
+
 		// incomming
-		auto& pk_q = it.second.packets_lossless_internal;
-		for (auto q_it = pk_q.begin(); q_it != pk_q.end();) {
+		auto& pk_q = f.packets_lossless_internal;
+		for (size_t q_i = 0; q_i < pk_q.size(); q_i++) {
+			const PacketView pk = pk_q[q_i];
+			if (pk.empty()) {
+				continue; // already handled
+			}
+
 			bool p_mod = false;
-			if ((*q_it).size() < 2) {
+			if (pk.size() < 2) {
 				LOG_WARN("malformed internal pkg detected");
-				q_it = pk_q.erase(q_it);
+				pk_q.erase(q_i);
 				continue;
 			}
 
-			switch ((*q_it)[1]) {
+			switch (pk[1]) {
 				case ToxInternalPkgID::MM_INSTANCE:
 					p_mod = true;
-					if ((*q_it).size() != __internal_pkg_MMInstance_size+2) {
-						LOG_ERROR("malformed internal pkg MM_INSTANCE detected, size:{} should:{}", (*q_it).size(), __internal_pkg_MMInstance_size+2);
+					if (pk.size() != __internal_pkg_MMInstance_size+2) {
+						LOG_ERROR("malformed internal pkg MM_INSTANCE detected, size:{} should:{}", pk.size(), __internal_pkg_MMInstance_size+2);
 						break;
 					}
 
-					if (__internal_pkg_MMInstance_is_magic_correct((*q_it).data() + 2u)) {
-						it.second.mm_instance = true;
+					if (__internal_pkg_MMInstance_is_magic_correct(pk.data() + 2u)) {
+						f.mm_instance = true;
+						if (_tox_friends_info[f_id].hello.protocol_version == 0) {
+							// does not know MM_HELLO (or it is still on the way), answer in kind
+							send_hello_legacy(f_id);
+						}
 					} else {
 						LOG_ERROR("malformed internal pkg MM_INSTANCE magic detected");
 					}
 					break;
 				case ToxInternalPkgID::MM_APP:
 					p_mod = true;
-					if ((*q_it).size() != __internal_pkg_MMApp_size+2) {
-						LOG_ERROR("malformed internal pkg MM_APP detected, size:{} should:{}", (*q_it).size(), __internal_pkg_MMApp_size+2);
+					if (pk.size() != __internal_pkg_MMApp_size+2) {
+						LOG_ERROR("malformed internal pkg MM_APP detected, size:{} should:{}", pk.size(), __internal_pkg_MMApp_size+2);
 						break;
 					}
 
-					it.second.mm_app = std::string_view{reinterpret_cast<const char*>((*q_it).data()+2), __internal_pkg_MMApp_size};
+					if (_tox_friends_info[f_id].hello.protocol_version == 0) { // MM_HELLO has the unpadded one
+						std::string_view app {reinterpret_cast<const char*>(pk.data()+2), __internal_pkg_MMApp_size};
+						_tox_friends_info[f_id].mm_app = app.substr(0, app.find('\0'));
+					}
+					break;
+				case ToxInternalPkgID::MM_HELLO:
+					p_mod = true;
+					handle_hello(f_id, f, pk);
 					break;
 			}
 
 			if (p_mod) {
-				q_it = pk_q.erase(q_it);
-			} else {
-				q_it++;
+				pk_q.erase(q_i);
 			}
 		}
 
 		// not connected (anymore???)
-		if (it.second.connection_status == Tox_Connection::TOX_CONNECTION_NONE) {
+		// stays dirty, reconnecting makes it active again
+		if (f.connection_status == Tox_Connection::TOX_CONNECTION_NONE) {
 			continue;
 		}
 
 		// outgoing
-		if (it.second.__dirty) {
-			it.second.__dirty = false;
-
-			{ // mm instance
-				static std::array<uint8_t, 2+8> mm_inst_arr {
-					MM_TOX_LOSSLESS_PKG_ID_INTERNAL,
-					ToxInternalPkgID::MM_INSTANCE,
-					0x83u,
-					0xafu,
-					0x33u,
-					0x31u,
-					0x70u,
-					0x62u,
-					0x33u,
-					0x88u,
-				};
-				friend_send_packet_lossless(it.first, mm_inst_arr.data(), mm_inst_arr.size());
+		if (f.__dirty) {
+			f.__dirty = false;
+
+			send_hello(f_id);
+		}
+	}
+
+
+	link_ping();
+
+	if (_state_dirty) {
+		const auto now = std::chrono::steady_clock::now();
+		if (now - _save_last >= _save_interval) {
+			update_savefile(engine);
+			_state_dirty = false;
+			_save_last = now;
+		}
+	}
+}
+
+void ToxService::pkg_cleanup(Engine&) {
+	// rings keep their slots for the next tick
+	for (const uint32_t f_id : _tox_friends_active) {
+		auto& f = _tox_friends.at(f_id);
+		f.packets.clear();
+		f.packets_internal.clear();
+		f.packets_lossless.clear();
+		f.packets_lossless_internal.clear();
+		f.__active = false;
+	}
+	_tox_friends_active.clear();
+
+	for (const auto& [group_number, peer_id] : _tox_groups_active) {
+		if (auto* group = _tox_groups.find(group_number); group != nullptr) {
+			if (auto* peer = group->peers.find(peer_id); peer != nullptr) {
+				peer->packets.clear();
+				peer->__active = false;
 			}
+		}
+	}
+	_tox_groups_active.clear();
+}
+
+ToxService::ToxFriend& ToxService::friend_mark_active(uint32_t friend_number) {
+	auto& f = _tox_friends[friend_number];
+	if (!f.__active) {
+		f.__active = true;
+		_tox_friends_active.push_back(friend_number);
+	}
+	return f;
+}
 
-			// TODO: this is one hell of .... bad code, just rewrite plz
-			{ // app name
-				if (_app_name.size() != 256-2) {
-					_app_name.resize(256-2);
+void ToxService::thread_start(void) {
+	assert(!_thread.joinable());
+
+	_thread_quit = false;
+	_thread = std::thread([this]() { thread_main(); });
+}
+
+void ToxService::thread_stop(void) {
+	if (!_thread.joinable()) {
+		return;
+	}
+
+	{
+		std::lock_guard lg{_thread_wake_mutex};
+		_thread_quit = true;
+	}
+	_thread_wake_cv.notify_one();
+	_thread.join();
+
+	// apply whatever is left, so nothing is lost (and nothing leaks)
+	thread_drain();
+
+	ToxThreadSendPkg pkg;
+	while (_thread_send_queue.pop(pkg)) {} // tox is going away
+	_thread_sendq.clear();
+	_thread_sendq_friends.clear();
+
+	std::lock_guard lg{_thread_sendq_stats_mutex};
+	_thread_sendq_stats.clear();
+}
+
+void ToxService::thread_main(void) {
+	__tls_recording_ts = this;
+
+	while (!_thread_quit) {
+		{ // outgoing first, so packets queued last tick go out with this iteration
+			ToxThreadSendPkg pkg;
+			while (_thread_send_queue.pop(pkg)) {
+				if (pkg.target != ToxThreadSendPkg::FRIEND) {
+					group_send_now(pkg.target, pkg.friend_number, pkg.group_peer_id, pkg.lossless, pkg.data.data(), pkg.data.size());
+					continue;
 				}
 
-				std::array<uint8_t, 256> mm_app_arr {
-					MM_TOX_LOSSLESS_PKG_ID_INTERNAL,
-					ToxInternalPkgID::MM_APP,
-				};
-				for (size_t i = 2; i < 256; i++) {
-					mm_app_arr[i] = _app_name[i-2];
+				if (pkg.lossless) {
+					// behind whatever is still waiting, to keep the order
+					auto& q = _thread_sendq[pkg.friend_number];
+					if (!q.packets.push(pkg.data.data(), pkg.data.size())) {
+						LOG_ERROR("sending packet to friend failed: " "packet too large");
+						continue;
+					}
+					if (!q.__in_list) {
+						q.__in_list = true;
+						_thread_sendq_friends.push_back(pkg.friend_number);
+					}
+					continue;
+				}
+
+				Tox_Err_Friend_Custom_Packet err_f_send = TOX_ERR_FRIEND_CUSTOM_PACKET_OK;
+				tox_friend_send_lossy_packet(_tox, pkg.friend_number, pkg.data.data(), pkg.data.size(), &err_f_send);
+				if (err_f_send != TOX_ERR_FRIEND_CUSTOM_PACKET_OK) {
+					log_custom_packet_error(err_f_send);
+				}
+			}
+
+			thread_flush_sendq();
+		}
+
+		Tox_Err_Events_Iterate err_e_it = TOX_ERR_EVENTS_ITERATE_OK;
+		Tox_Events* events = tox_events_iterate(_tox, false, &err_e_it);
+		if (err_e_it != TOX_ERR_EVENTS_ITERATE_OK) {
+			LOG_ERROR("tox_events_iterate failed with error code {}", err_e_it);
+		}
+
+		// null if nothing happend, the ngc events go along with the batch
+		if (events != nullptr || !_group_events_recording.empty()) {
+			ToxEventBatch batch{events, std::move(_group_events_recording)};
+			_group_events_recording.clear();
+
+			// the tick is lagging behind, wait for it rather than dropping events.
+			// outside of toxcores lock, so the tick can still call into tox
+			while (!_thread_events_queue.push(std::move(batch))) {
+				if (_thread_quit) {
+					if (batch.events != nullptr) {
+						tox_events_free(batch.events);
+					}
+					break;
 				}
-				friend_send_packet_lossless(it.first, mm_app_arr.data(), mm_app_arr.size());
+				std::this_thread::yield();
 			}
 		}
+
+		std::unique_lock lk{_thread_wake_mutex};
+		_thread_wake_cv.wait_for(
+			lk,
+			std::chrono::milliseconds(tox_iteration_interval(_tox)),
+			[this]() { return _thread_quit || !_thread_send_queue.empty(); }
+		);
 	}
 
+	__tls_recording_ts = nullptr;
+}
 
-	if (_state_dirty) {
-		update_savefile(engine);
-		_state_dirty = false;
+void ToxService::record_group_event(ToxGroupEvent&& e) {
+	_group_events_recording.push_back(std::move(e));
+}
+
+bool ToxService::thread_queue_send(uint32_t friend_number, bool lossless, const uint8_t* mem, size_t size) {
+	if (lossless && friend_sendq_size(friend_number) >= _sendq_max_packets) {
+		LOG_ERROR("sending packet to friend failed: " "sendq full");
+		return false;
+	}
+
+	if (!_thread_send_queue.push({friend_number, lossless, {mem, mem+size}})) {
+		LOG_ERROR("sending packet to friend failed: " "thread send queue full");
+		return false;
+	}
+
+	{ // wake the worker, taking the lock so the wakeup can not get lost
+		std::lock_guard lg{_thread_wake_mutex};
+	}
+	_thread_wake_cv.notify_one();
+
+	return true;
+}
+
+bool ToxService::thread_queue_send_group(ToxThreadSendPkg::Target target, uint32_t group_number, uint32_t peer_id, bool lossless, const uint8_t* mem, size_t size) {
+	if (!_thread_send_queue.push({group_number, lossless, {mem, mem+size}, target, peer_id})) {
+		LOG_ERROR("sending packet to group failed: " "thread send queue full");
+		return false;
+	}
+
+	{ // wake the worker, taking the lock so the wakeup can not get lost
+		std::lock_guard lg{_thread_wake_mutex};
 	}
+	_thread_wake_cv.notify_one();
+
+	return true;
 }
 
-void ToxService::pkg_cleanup(Engine&) {
-	for (auto&& it : _tox_friends) {
-		it.second.packets.clear();
-		it.second.packets_internal.clear();
-		it.second.packets_lossless.clear();
-		it.second.packets_lossless_internal.clear();
+void ToxService::thread_flush_sendq(void) {
+	for (const uint32_t f_id : _thread_sendq_friends) {
+		auto& q = _thread_sendq.at(f_id).packets;
+
+		while (!q.empty()) {
+			const PacketView pk = q[0];
+
+			Tox_Err_Friend_Custom_Packet err_f_send = TOX_ERR_FRIEND_CUSTOM_PACKET_OK;
+			tox_friend_send_lossless_packet(_tox, f_id, pk.data(), pk.size(), &err_f_send);
+			if (err_f_send == TOX_ERR_FRIEND_CUSTOM_PACKET_SENDQ) {
+				break; // the rest of this friend waits, next iteration
+			}
+
+			if (
+				err_f_send == TOX_ERR_FRIEND_CUSTOM_PACKET_FRIEND_NOT_CONNECTED ||
+				err_f_send == TOX_ERR_FRIEND_CUSTOM_PACKET_FRIEND_NOT_FOUND
+			) {
+				LOG_WARN("friend {} gone, dropping {} queued packets", f_id, q.size());
+				q.clear();
+				break;
+			}
+
+			if (err_f_send != TOX_ERR_FRIEND_CUSTOM_PACKET_OK) {
+				log_custom_packet_error(err_f_send);
+			}
+			q.pop_front();
+		}
+	}
+
+	{ // only friends that had something queued can have changed
+		std::lock_guard lg{_thread_sendq_stats_mutex};
+		for (const uint32_t f_id : _thread_sendq_friends) {
+			auto& stats = _thread_sendq_stats[f_id];
+			stats.size = _thread_sendq.at(f_id).packets.size();
+			stats.high_water = std::max(stats.high_water, stats.size);
+		}
+	}
+
+	for (size_t i = 0; i < _thread_sendq_friends.size();) {
+		auto& q = _thread_sendq.at(_thread_sendq_friends[i]);
+		if (q.packets.empty()) {
+			q.packets.shrink(sendq_keep_slots);
+			q.__in_list = false;
+			// swap remove, order between friends does not matter
+			_thread_sendq_friends[i] = _thread_sendq_friends.back();
+			_thread_sendq_friends.pop_back();
+		} else {
+			i++;
+		}
 	}
 }
 
+void ToxService::thread_drain(void) {
+	ToxEventBatch batch;
+	while (_thread_events_queue.pop(batch)) {
+		if (batch.events != nullptr) {
+			apply_events(batch.events);
+			tox_events_free(batch.events);
+		}
+		apply_group_events(batch.group_events);
+	}
+}
+
+void ToxService::apply_events(const Tox_Events* events) {
+	if (_events_record_fn) {
+		std::vector<uint8_t> bytes(tox_events_bytes_size(events));
+		tox_events_get_bytes(events, bytes.data());
+		_events_record_fn(bytes.data(), bytes.size());
+	}
+
+	// the rare ones
+	dispatch_tox_events(_tox, events, this);
+
+	enum : uint8_t { // applied in this order for each friend
+		CONNECTION_STATUS,
+		LOSSLESS_PACKET,
+		LOSSY_PACKET,
+	};
+
+	const uint32_t conn_count = tox_events_get_friend_connection_status_size(events);
+	const uint32_t lossless_count = tox_events_get_friend_lossless_packet_size(events);
+	const uint32_t lossy_count = tox_events_get_friend_lossy_packet_size(events);
+
+	_events_friend_scratch.clear();
+	_events_friend_scratch.reserve(conn_count + lossless_count + lossy_count);
+	for (uint32_t i = 0; i < conn_count; i++) {
+		_events_friend_scratch.push_back({tox_event_friend_connection_status_get_friend_number(tox_events_get_friend_connection_status(events, i)), CONNECTION_STATUS, i});
+	}
+	for (uint32_t i = 0; i < lossless_count; i++) {
+		_events_friend_scratch.push_back({tox_event_friend_lossless_packet_get_friend_number(tox_events_get_friend_lossless_packet(events, i)), LOSSLESS_PACKET, i});
+	}
+	for (uint32_t i = 0; i < lossy_count; i++) {
+		_events_friend_scratch.push_back({tox_event_friend_lossy_packet_get_friend_number(tox_events_get_friend_lossy_packet(events, i)), LOSSY_PACKET, i});
+	}
+
+	// index is part of the key, to keep arrival order, without stable_sort()s allocation
+	std::sort(_events_friend_scratch.begin(), _events_friend_scratch.end(), [](const auto& a, const auto& b) {
+		return std::tie(a.friend_number, a.kind, a.index) < std::tie(b.friend_number, b.kind, b.index);
+	});
+
+	// one lookup per friend, not per event
+	ToxFriend* f = nullptr;
+	uint32_t f_number = 0;
+	for (const auto& ref : _events_friend_scratch) {
+		if (f == nullptr || f_number != ref.friend_number) {
+			f_number = ref.friend_number;
+			f = &friend_mark_active(f_number);
+		}
+
+		switch (ref.kind) {
+			case CONNECTION_STATUS: {
+					const auto connection_status = tox_event_friend_connection_status_get_connection_status(tox_events_get_friend_connection_status(events, ref.index));
+					if ((connection_status == TOX_CONNECTION_NONE) != (f->connection_status == TOX_CONNECTION_NONE)) {
+						// a new session, udp <-> tcp keeps the handshake
+						f->connection_generation++;
+						f->__dirty = true;
+						f->caps = 0;
+						_tox_friends_info[f_number].hello = {};
+					}
+					f->connection_status = connection_status;
+				}
+				f->link.reset(f->connection_status == TOX_CONNECTION_UDP, std::chrono::steady_clock::now());
+				break;
+			case LOSSLESS_PACKET: {
+					const auto* e = tox_events_get_friend_lossless_packet(events, ref.index);
+					const uint8_t* data = tox_event_friend_lossless_packet_get_data(e);
+					const size_t length = tox_event_friend_lossless_packet_get_data_length(e);
+					if (length == 0) {
+						break;
+					}
+
+					if (data[0] == MM_TOX_LOSSLESS_PKG_ID_INTERNAL) {
+						f->packets_lossless_internal.push(data, length);
+					} else {
+						f->packets_lossless.push(data, length);
+					}
+				}
+				break;
+			case LOSSY_PACKET: {
+					const auto* e = tox_events_get_friend_lossy_packet(events, ref.index);
+					const uint8_t* data = tox_event_friend_lossy_packet_get_data(e);
+					const size_t length = tox_event_friend_lossy_packet_get_data_length(e);
+					if (length == 0) {
+						break;
+					}
+
+					if (data[0] == MM_TOX_LOSSY_PKG_ID_INTERNAL) {
+						f->packets_internal.push(data, length);
+					} else {
+						f->packets.push(data, length);
+					}
+				}
+				break;
+		}
+	}
+}
+
+bool ToxService::replay_events(const uint8_t* data, size_t size) {
+	Tox_Events* events = tox_events_load(data, size);
+	if (events == nullptr) {
+		LOG_ERROR("replaying events failed, malformed batch");
+		return false;
+	}
+
+	apply_events(events);
+	tox_events_free(events);
+
+	return true;
+}
+
+void ToxService::apply_group_events(std::vector<ToxGroupEvent>& group_events) {
+	// in recorded order, since most of them depend on each other (join, name, exit ...)
+	for (auto& e : group_events) {
+		// not recording anymore, so the callbacks do the actual work now
+		switch (e.type) {
+			case ToxGroupEvent::PEER_NAME:
+				group_peer_name_cb(_tox, e.group_number, e.peer_id, e.data.data(), e.data.size(), this);
+				break;
+			case ToxGroupEvent::PEER_STATUS:
+				group_peer_status_cb(_tox, e.group_number, e.peer_id, Tox_User_Status(e.value), this);
+				break;
+			case ToxGroupEvent::TOPIC:
+				group_topic_cb(_tox, e.group_number, e.peer_id, e.data.data(), e.data.size(), this);
+				break;
+			case ToxGroupEvent::PRIVACY_STATE:
+				group_privacy_state_cb(_tox, e.group_number, Tox_Group_Privacy_State(e.value), this);
+				break;
+			case ToxGroupEvent::VOICE_STATE:
+				group_voice_state_cb(_tox, e.group_number, Tox_Group_Voice_State(e.value), this);
+				break;
+			case ToxGroupEvent::TOPIC_LOCK:
+				group_topic_lock_cb(_tox, e.group_number, Tox_Group_Topic_Lock(e.value), this);
+				break;
+			case ToxGroupEvent::PEER_LIMIT:
+				group_peer_limit_cb(_tox, e.group_number, e.value, this);
+				break;
+			case ToxGroupEvent::PASSWORD:
+				group_password_cb(_tox, e.group_number, e.data.data(), e.data.size(), this);
+				break;
+			case ToxGroupEvent::MESSAGE:
+				group_message_cb(_tox, e.group_number, e.peer_id, Tox_Message_Type(e.value), e.data.data(), e.data.size(), e.value2, this);
+				break;
+			case ToxGroupEvent::PRIVATE_MESSAGE:
+				group_private_message_cb(_tox, e.group_number, e.peer_id, Tox_Message_Type(e.value), e.data.data(), e.data.size(), this);
+				break;
+			case ToxGroupEvent::CUSTOM_PACKET:
+				group_custom_packet_cb(_tox, e.group_number, e.peer_id, e.data.data(), e.data.size(), this);
+				break;
+			case ToxGroupEvent::CUSTOM_PRIVATE_PACKET:
+				group_custom_private_packet_cb(_tox, e.group_number, e.peer_id, e.data.data(), e.data.size(), this);
+				break;
+			case ToxGroupEvent::INVITE:
+				group_invite_cb(_tox, e.group_number, e.data.data(), e.data.size(), e.data2.data(), e.data2.size(), this);
+				break;
+			case ToxGroupEvent::PEER_JOIN:
+				group_peer_join_cb(_tox, e.group_number, e.peer_id, this);
+				break;
+			case ToxGroupEvent::PEER_EXIT:
+				group_peer_exit_cb(_tox, e.group_number, e.peer_id, Tox_Group_Exit_Type(e.value), e.data.data(), e.data.size(), e.data2.data(), e.data2.size(), this);
+				break;
+			case ToxGroupEvent::SELF_JOIN:
+				group_self_join_cb(_tox, e.group_number, this);
+				break;
+			case ToxGroupEvent::JOIN_FAIL:
+				group_join_fail_cb(_tox, e.group_number, Tox_Group_Join_Fail(e.value), this);
+				break;
+			case ToxGroupEvent::MODERATION:
+				group_moderation_cb(_tox, e.group_number, e.peer_id, e.value, Tox_Group_Mod_Event(e.value2), this);
+				break;
+		}
+	}
+
+	group_events.clear();
+}
+
 void ToxService::update_savefile(Engine& engine) {
 	if (_path_to_toxsave.empty()) {
 		return;
 	}
 
-	std::vector<uint8_t> save_mem(tox_get_savedata_size(_tox));
-	tox_get_savedata(_tox, save_mem.data());
+	// no alloc, as long as the save does not grow
+	_save_snapshot.resize(tox_get_savedata_size(_tox));
+	tox_get_savedata(_tox, _save_snapshot.data());
 
-	auto& fs = engine.getService<MM::Services::FilesystemService>();
-	auto file = fs.open(_path_to_toxsave.c_str(), MM::Services::FilesystemService::FOPEN_t::WRITE);
-
-	if (!file) {
-		// error
+	if (_save_writer) {
+		_save_writer->submit(_save_snapshot);
 		return;
 	}
 
-	fs.write(file, save_mem.data(), save_mem.size());
+	write_savefile(engine.getService<MM::Services::FilesystemService>(), _path_to_toxsave, _save_snapshot.data(), _save_snapshot.size());
 }
 
 bool ToxService::friend_send_message(uint32_t friend_number, std::string_view msg) {
@@ -570,7 +1184,7 @@ bool ToxService::friend_send_message(uint32_t friend_number, std::string_view ms
 	bool succ = err_f_send_m == Tox_Err_Friend_Send_Message::TOX_ERR_FRIEND_SEND_MESSAGE_OK;
 
 	if (succ) {
-		_tox_friends[friend_number].messages.emplace_back(
+		_tox_friends_info[friend_number].messages.emplace_back(
 			true,
 			Tox_Message_Type::TOX_MESSAGE_TYPE_NORMAL,
 			msg
@@ -598,7 +1212,7 @@ bool ToxService::conference_send_message(uint32_t conference_number, std::string
 bool ToxService::broadcast_message(std::string_view msg) {
 	bool res = true;
 
-	for (auto& f : _tox_friends) {
+	for (auto&& f : _tox_friends) {
 		res &= friend_send_message(f.first, msg);
 	}
 
@@ -610,31 +1224,31 @@ bool ToxService::friend_send_packet(uint32_t friend_number, uint8_t* mem, size_t
 		LOG_ERROR("sending packet to friend failed: size is zero!");
 		return false;
 	}
-	if (mem[0] < 200 || mem[0] > 254) {
+	if (mem[0] < 192 || mem[0] > 254) {
 		LOG_ERROR("sending packet to friend failed: first byte not in range!");
 		return false;
 	}
 
+	if (_threaded) {
+		if (!thread_queue_send(friend_number, false, mem, size)) {
+			return false;
+		}
+		if (auto* f = _tox_friends.find(friend_number); f != nullptr) {
+			f->link.on_sent(size); // SENDQ happens on the worker, this only sees the rate
+		}
+		return true;
+	}
+
 	TOX_ERR_FRIEND_CUSTOM_PACKET err_f_send;
 	if (!tox_friend_send_lossy_packet(_tox, friend_number, mem, size, &err_f_send)) {
-		if (err_f_send == Tox_Err_Friend_Custom_Packet::TOX_ERR_FRIEND_CUSTOM_PACKET_EMPTY) {
-			LOG_ERROR("sending packet to friend failed: " "EMPTY");
-		} else if (err_f_send == Tox_Err_Friend_Custom_Packet::TOX_ERR_FRIEND_CUSTOM_PACKET_TOO_LONG) {
-			LOG_ERROR("sending packet to friend failed: " "TOO_LONG");
-		} else if (err_f_send == Tox_Err_Friend_Custom_Packet::TOX_ERR_FRIEND_CUSTOM_PACKET_FRIEND_NOT_CONNECTED) {
-			LOG_ERROR("sending packet to friend failed: " "FRIEND_NOT_CONNECTED");
-		} else if (err_f_send == Tox_Err_Friend_Custom_Packet::TOX_ERR_FRIEND_CUSTOM_PACKET_NULL) {
-			LOG_ERROR("sending packet to friend failed: " "NULL");
-		} else if (err_f_send == Tox_Err_Friend_Custom_Packet::TOX_ERR_FRIEND_CUSTOM_PACKET_SENDQ) {
-			LOG_ERROR("sending packet to friend failed: " "SENDQ");
-		} else if (err_f_send == Tox_Err_Friend_Custom_Packet::TOX_ERR_FRIEND_CUSTOM_PACKET_INVALID) {
-			LOG_ERROR("sending packet to friend failed: " "INVALID");
-		} else if (err_f_send == Tox_Err_Friend_Custom_Packet::TOX_ERR_FRIEND_CUSTOM_PACKET_FRIEND_NOT_FOUND) {
-			LOG_ERROR("sending packet to friend failed: " "FRIEND_NOT_FOUND");
-		}
+		log_custom_packet_error(err_f_send);
 		return false;
 	}
 
+	if (auto* f = _tox_friends.find(friend_number); f != nullptr) {
+		f->link.on_sent(size);
+	}
+
 	return true;
 }
 
@@ -648,33 +1262,397 @@ bool ToxService::friend_send_packet_lossless(uint32_t friend_number, uint8_t* me
 		return false;
 	}
 
+	if (_threaded) {
+		if (!thread_queue_send(friend_number, true, mem, size)) {
+			return false;
+		}
+		if (auto* f = _tox_friends.find(friend_number); f != nullptr) {
+			f->link.on_sent(size); // SENDQ happens on the worker, this only sees the rate
+		}
+		return true;
+	}
+
+	// behind whatever is still waiting, to keep the order
+	if (const auto* f = _tox_friends.find(friend_number); f != nullptr && !f->sendq.empty()) {
+		return sendq_push(friend_number, mem, size);
+	}
+
 	TOX_ERR_FRIEND_CUSTOM_PACKET err_f_send;
 	if (!tox_friend_send_lossless_packet(_tox, friend_number, mem, size, &err_f_send)) {
-		if (err_f_send == Tox_Err_Friend_Custom_Packet::TOX_ERR_FRIEND_CUSTOM_PACKET_EMPTY) {
-			LOG_ERROR("sending packet to friend failed: " "EMPTY");
-		} else if (err_f_send == Tox_Err_Friend_Custom_Packet::TOX_ERR_FRIEND_CUSTOM_PACKET_TOO_LONG) {
-			LOG_ERROR("sending packet to friend failed: " "TOO_LONG");
-		} else if (err_f_send == Tox_Err_Friend_Custom_Packet::TOX_ERR_FRIEND_CUSTOM_PACKET_FRIEND_NOT_CONNECTED) {
-			LOG_ERROR("sending packet to friend failed: " "FRIEND_NOT_CONNECTED");
-		} else if (err_f_send == Tox_Err_Friend_Custom_Packet::TOX_ERR_FRIEND_CUSTOM_PACKET_NULL) {
-			LOG_ERROR("sending packet to friend failed: " "NULL");
-		} else if (err_f_send == Tox_Err_Friend_Custom_Packet::TOX_ERR_FRIEND_CUSTOM_PACKET_SENDQ) {
-			LOG_ERROR("sending packet to friend failed: " "SENDQ");
-		} else if (err_f_send == Tox_Err_Friend_Custom_Packet::TOX_ERR_FRIEND_CUSTOM_PACKET_INVALID) {
-			LOG_ERROR("sending packet to friend failed: " "INVALID");
-		} else if (err_f_send == Tox_Err_Friend_Custom_Packet::TOX_ERR_FRIEND_CUSTOM_PACKET_FRIEND_NOT_FOUND) {
-			LOG_ERROR("sending packet to friend failed: " "FRIEND_NOT_FOUND");
+		if (err_f_send == TOX_ERR_FRIEND_CUSTOM_PACKET_SENDQ) {
+			return sendq_push(friend_number, mem, size);
 		}
+
+		log_custom_packet_error(err_f_send);
 		return false;
 	}
 
+	if (auto* f = _tox_friends.find(friend_number); f != nullptr) {
+		f->link.on_sent(size);
+	}
+
 	return true;
 }
 
+size_t ToxService::friend_sendq_size(uint32_t friend_number) const {
+	if (_threaded) {
+		std::lock_guard lg{_thread_sendq_stats_mutex};
+		const auto* stats = _thread_sendq_stats.find(friend_number);
+		return stats == nullptr ? 0 : stats->size;
+	}
+
+	const auto* f = _tox_friends.find(friend_number);
+	return f == nullptr ? 0 : f->sendq.size();
+}
+
+size_t ToxService::friend_sendq_high_water(uint32_t friend_number) const {
+	if (_threaded) {
+		std::lock_guard lg{_thread_sendq_stats_mutex};
+		const auto* stats = _thread_sendq_stats.find(friend_number);
+		return stats == nullptr ? 0 : stats->high_water;
+	}
+
+	const auto* f = _tox_friends.find(friend_number);
+	return f == nullptr ? 0 : f->sendq_high_water;
+}
+
+size_t ToxService::friend_sendq_space(uint32_t friend_number) const {
+	const size_t size = friend_sendq_size(friend_number);
+	const size_t space = size >= _sendq_max_packets ? 0 : _sendq_max_packets - size;
+
+	if (_threaded) {
+		// everything goes through the worker queue first
+		const size_t queued = _thread_send_queue.size();
+		const size_t queue_space = queued >= _thread_send_queue.capacity() ? 0 : _thread_send_queue.capacity() - queued;
+		return std::min(space, queue_space);
+	}
+
+	return space;
+}
+
+const LinkEstimator* ToxService::friend_link(uint32_t friend_number) const {
+	const auto* f = _tox_friends.find(friend_number);
+	return f == nullptr ? nullptr : &f->link;
+}
+
+size_t ToxService::friend_send_budget(uint32_t friend_number) const {
+	const auto* f = _tox_friends.find(friend_number);
+	return f == nullptr ? LinkEstimator::budget_min : f->link.budget();
+}
+
+void ToxService::caps_set(uint32_t caps) {
+	if (caps == _caps) {
+		return;
+	}
+	_caps = caps;
+
+	resend_hello();
+}
+
+void ToxService::lz_dict_id_set(uint32_t id) {
+	if (id == _lz_dict_id) {
+		return;
+	}
+	_lz_dict_id = id;
+
+	resend_hello();
+}
+
+void ToxService::resend_hello(void) {
+	for (auto&& [f_id, f] : _tox_friends) {
+		f.__dirty = true;
+		friend_mark_active(f_id);
+	}
+}
+
+uint32_t ToxService::friend_caps(uint32_t friend_number) const {
+	const auto* f = _tox_friends.find(friend_number);
+	return f == nullptr ? 0 : f->caps;
+}
+
+const ToxService::ToxHello* ToxService::friend_hello(uint32_t friend_number) const {
+	const auto* fi = _tox_friends_info.find(friend_number);
+	return fi == nullptr || fi->hello.protocol_version == 0 ? nullptr : &fi->hello;
+}
+
+uint8_t ToxService::friend_framing_version(uint32_t friend_number) const {
+	const auto* hello = friend_hello(friend_number);
+	return hello == nullptr ? 0 : hello->framing_version;
+}
+
+void ToxService::send_hello(uint32_t friend_number) {
+	// only on connection changes, the allocation does not matter
+	std::vector<uint8_t> pkg {
+		MM_TOX_LOSSLESS_PKG_ID_INTERNAL,
+		ToxInternalPkgID::MM_HELLO,
+	};
+	pkg.insert(pkg.end(), std::begin(__internal_pkg_MMInstance_magic), std::end(__internal_pkg_MMInstance_magic));
+
+	__internal_pkg_MMHello_put(pkg, HELLO_PROTOCOL_VERSION, MM_TOX_PROTOCOL_VERSION, 2);
+
+	const size_t app_size = std::min(_app_name.size(), __internal_pkg_MMHello_app_max);
+	pkg.push_back(HELLO_APP);
+	pkg.push_back(static_cast<uint8_t>(app_size));
+	pkg.insert(pkg.end(), _app_name.cbegin(), _app_name.cbegin() + app_size);
+
+	__internal_pkg_MMHello_put(pkg, HELLO_CAPS, _caps, 4);
+	__internal_pkg_MMHello_put(pkg, HELLO_FRAMING_VERSION, MM_TOX_FRAMING_VERSION, 1);
+	if (_lz_dict_id != 0) {
+		__internal_pkg_MMHello_put(pkg, HELLO_LZ_DICT, _lz_dict_id, 4);
+	}
+
+	friend_send_packet_lossless(friend_number, pkg.data(), pkg.size());
+}
+
+void ToxService::send_hello_legacy(uint32_t friend_number) {
+	// the old handshake, peers from before MM_HELLO only know these. newer ones get the same from MM_HELLO
+	{ // mm instance
+		std::array<uint8_t, 2+__internal_pkg_MMInstance_size> mm_inst_arr {
+			MM_TOX_LOSSLESS_PKG_ID_INTERNAL,
+			ToxInternalPkgID::MM_INSTANCE,
+		};
+		std::copy(std::begin(__internal_pkg_MMInstance_magic), std::end(__internal_pkg_MMInstance_magic), mm_inst_arr.begin() + 2);
+		friend_send_packet_lossless(friend_number, mm_inst_arr.data(), mm_inst_arr.size());
+	}
+
+	{ // app name, zero padded
+		std::array<uint8_t, 2+__internal_pkg_MMApp_size> mm_app_arr {
+			MM_TOX_LOSSLESS_PKG_ID_INTERNAL,
+			ToxInternalPkgID::MM_APP,
+		};
+		std::copy_n(_app_name.cbegin(), std::min(_app_name.size(), __internal_pkg_MMApp_size), mm_app_arr.begin() + 2);
+		friend_send_packet_lossless(friend_number, mm_app_arr.data(), mm_app_arr.size());
+	}
+}
+
+void ToxService::handle_hello(uint32_t friend_number, ToxFriend& f, const PacketView& pk) {
+	if (pk.size() < 2+__internal_pkg_MMInstance_size || !__internal_pkg_MMInstance_is_magic_correct(pk.data() + 2)) {
+		LOG_ERROR("malformed internal pkg MM_HELLO magic detected");
+		return;
+	}
+
+	// parse everything first, a malformed pkg changes nothing
+	std::string_view app;
+	uint32_t caps = 0;
+	ToxHello hello;
+
+	for (size_t i = 2+__internal_pkg_MMInstance_size; i < pk.size();) {
+		if (pk.size() - i < 2 || pk.size() - i - 2 < pk[i+1]) {
+			LOG_ERROR("malformed internal pkg MM_HELLO detected, entry at {} exceeds size {}", i, pk.size());
+			return;
+		}
+
+		const uint8_t type = pk[i];
+		const uint8_t length = pk[i+1];
+		const uint8_t* value = pk.data() + i + 2;
+		i += 2 + length;
+
+		// known types need at least their size, newer versions may append to them
+		const auto need = [length, type](size_t size) {
+			if (length < size) {
+				LOG_ERROR("malformed internal pkg MM_HELLO entry {} detected, size:{} should:{}", type, length, size);
+				return false;
+			}
+			return true;
+		};
+
+		switch (type) {
+			case HELLO_PROTOCOL_VERSION:
+				if (!need(2)) return;
+				hello.protocol_version = static_cast<uint16_t>(__internal_pkg_MMHello_get(value, 2));
+				break;
+			case HELLO_APP:
+				app = std::string_view{reinterpret_cast<const char*>(value), length};
+				break;
+			case HELLO_CAPS:
+				if (!need(4)) return;
+				caps = __internal_pkg_MMHello_get(value, 4);
+				break;
+			case HELLO_FRAMING_VERSION:
+				if (!need(1)) return;
+				hello.framing_version = value[0];
+				break;
+			case HELLO_LZ_DICT:
+				if (!need(4)) return;
+				hello.lz_dict_id = __internal_pkg_MMHello_get(value, 4);
+				break;
+			default:
+				break; // newer than us
+		}
+	}
+
+	if (hello.protocol_version == 0) {
+		LOG_ERROR("internal pkg MM_HELLO without protocol version detected");
+		return;
+	}
+
+	if (hello.protocol_version != MM_TOX_PROTOCOL_VERSION) {
+		LOG_WARN("friend {} uses protocol version {}, we {}", friend_number, hello.protocol_version, MM_TOX_PROTOCOL_VERSION);
+	}
+
+	f.mm_instance = true;
+	f.caps = caps;
+
+	auto& fi = _tox_friends_info[friend_number];
+	fi.mm_app = app;
+	fi.hello = hello;
+}
+
+// ms, wraps, only ever compared to itself
+static uint32_t link_timestamp(void) {
+	return static_cast<uint32_t>(std::chrono::duration_cast<std::chrono::milliseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()
+	).count());
+}
+
+// ms since the unix epoch, comparable across machines (if their clocks are set)
+static int64_t link_wall_timestamp(void) {
+	return std::chrono::duration_cast<std::chrono::milliseconds>(
+		std::chrono::system_clock::now().time_since_epoch()
+	).count();
+}
+
+// ping: id, type, seq (2 bytes), timestamp (4 bytes), all little endian
+// pong: the ping + wall clock of the responder (8 bytes, signed ms since the unix epoch)
+constexpr size_t __internal_pkg_link_size = 2+2+4;
+constexpr size_t __internal_pkg_link_pong_size = __internal_pkg_link_size+8;
+
+void ToxService::link_handle_internal(uint32_t friend_number, ToxFriend& f) {
+	f.packets_internal.each([this, friend_number, &f](PacketView& pk) {
+		if (pk.size() < 2 || pk.size() != (pk[1] == ToxInternalPkgID::LINK_PONG ? __internal_pkg_link_pong_size : __internal_pkg_link_size)) {
+			LOG_WARN("malformed internal lossy pkg detected");
+			return;
+		}
+
+		if (pk[1] == ToxInternalPkgID::LINK_PING) {
+			// echo it back, with our clock
+			std::array<uint8_t, __internal_pkg_link_pong_size> pong;
+			std::copy(pk.cbegin(), pk.cend(), pong.begin());
+			pong[1] = ToxInternalPkgID::LINK_PONG;
+
+			const uint64_t wall = static_cast<uint64_t>(link_wall_timestamp());
+			for (size_t i = 0; i < 8; i++) {
+				pong[__internal_pkg_link_size + i] = (wall >> (i*8)) & 0xff;
+			}
+
+			friend_send_packet(friend_number, pong.data(), pong.size());
+		} else if (pk[1] == ToxInternalPkgID::LINK_PONG) {
+			const uint32_t sent_ts = pk[4] | (uint32_t(pk[5]) << 8) | (uint32_t(pk[6]) << 16) | (uint32_t(pk[7]) << 24);
+			const float rtt_ms = static_cast<float>(link_timestamp() - sent_ts);
+			f.link.on_pong(rtt_ms);
+
+			uint64_t remote_wall = 0;
+			for (size_t i = 0; i < 8; i++) {
+				remote_wall |= uint64_t(pk[__internal_pkg_link_size + i]) << (i*8);
+			}
+			// the remote read its clock about half a rtt ago
+			const double local_wall = static_cast<double>(link_wall_timestamp()) - rtt_ms / 2.;
+			f.link.on_clock_sample(static_cast<double>(static_cast<int64_t>(remote_wall)) - local_wall, rtt_ms);
+		}
+	});
+}
+
+void ToxService::link_ping(void) {
+	const auto now = std::chrono::steady_clock::now();
+	if (now - _link_ping_last < _link_ping_interval) {
+		return;
+	}
+	_link_ping_last = now;
+
+	const uint32_t ts = link_timestamp();
+
+	// once per interval, so walking all friends is fine
+	for (auto&& [f_id, f] : _tox_friends) {
+		if (f.connection_status == TOX_CONNECTION_NONE || !f.mm_instance) {
+			continue;
+		}
+
+		f.link.update(now);
+
+		const uint16_t seq = f.link_ping_seq++;
+		std::array<uint8_t, __internal_pkg_link_size> ping {
+			MM_TOX_LOSSY_PKG_ID_INTERNAL,
+			ToxInternalPkgID::LINK_PING,
+			uint8_t(seq & 0xff), uint8_t(seq >> 8),
+			uint8_t(ts & 0xff), uint8_t((ts >> 8) & 0xff), uint8_t((ts >> 16) & 0xff), uint8_t((ts >> 24) & 0xff),
+		};
+		if (friend_send_packet(f_id, ping.data(), ping.size())) {
+			f.link.on_ping_sent();
+		}
+	}
+}
+
+bool ToxService::sendq_push(uint32_t friend_number, const uint8_t* mem, size_t size) {
+	auto& f = _tox_friends[friend_number];
+
+	if (f.sendq.size() >= _sendq_max_packets) {
+		LOG_ERROR("sending packet to friend failed: " "sendq full");
+		return false;
+	}
+
+	if (!f.sendq.push(mem, size)) {
+		LOG_ERROR("sending packet to friend failed: " "TOO_LONG");
+		return false;
+	}
+
+	f.sendq_high_water = std::max(f.sendq_high_water, f.sendq.size());
+	f.link.on_sendq();
+
+	if (!f.__in_sendq) {
+		f.__in_sendq = true;
+		_tox_friends_sendq.push_back(friend_number);
+	}
+
+	return true;
+}
+
+void ToxService::sendq_flush(void) {
+	for (size_t i = 0; i < _tox_friends_sendq.size();) {
+		const uint32_t f_id = _tox_friends_sendq[i];
+		auto& f = _tox_friends.at(f_id);
+
+		while (!f.sendq.empty()) {
+			const PacketView pk = f.sendq[0];
+
+			TOX_ERR_FRIEND_CUSTOM_PACKET err_f_send = TOX_ERR_FRIEND_CUSTOM_PACKET_OK;
+			tox_friend_send_lossless_packet(_tox, f_id, pk.data(), pk.size(), &err_f_send);
+			if (err_f_send == TOX_ERR_FRIEND_CUSTOM_PACKET_SENDQ) {
+				break; // still full, next iterate
+			}
+
+			if (
+				err_f_send == TOX_ERR_FRIEND_CUSTOM_PACKET_FRIEND_NOT_CONNECTED ||
+				err_f_send == TOX_ERR_FRIEND_CUSTOM_PACKET_FRIEND_NOT_FOUND
+			) {
+				LOG_WARN("friend {} gone, dropping {} queued packets", f_id, f.sendq.size());
+				f.sendq.clear();
+				break;
+			}
+
+			if (err_f_send != TOX_ERR_FRIEND_CUSTOM_PACKET_OK) {
+				log_custom_packet_error(err_f_send);
+			} else {
+				f.link.on_sent(pk.size());
+			}
+			f.sendq.pop_front();
+		}
+
+		if (f.sendq.empty()) {
+			f.sendq.shrink(sendq_keep_slots);
+			f.__in_sendq = false;
+			// swap remove, order between friends does not matter
+			_tox_friends_sendq[i] = _tox_friends_sendq.back();
+			_tox_friends_sendq.pop_back();
+		} else {
+			i++;
+		}
+	}
+}
+
 bool ToxService::broadcast_packet(uint8_t* mem, size_t size) {
 	bool res = true;
 
-	for (auto& f : _tox_friends) {
+	for (auto&& f : _tox_friends) {
 		if (f.second.connection_status != Tox_Connection::TOX_CONNECTION_NONE) {
 			res &= friend_send_packet(f.first, mem, size);
 		}
@@ -686,7 +1664,7 @@ bool ToxService::broadcast_packet(uint8_t* mem, size_t size) {
 bool ToxService::broadcast_packet_lossless(uint8_t* mem, size_t size) {
 	bool res = true;
 
-	for (auto& f : _tox_friends) {
+	for (auto&& f : _tox_friends) {
 		if (f.second.connection_status != Tox_Connection::TOX_CONNECTION_NONE) {
 			res &= friend_send_packet_lossless(f.first, mem, size);
 		}
@@ -729,6 +1707,52 @@ bool ToxService::add_friend(std::string_view text_tox_id, std::string_view msg)
 	return add_friend(bin_rep, msg);
 }
 
+bool ToxService::group_send_packet(uint32_t group_number, bool lossless, const uint8_t* mem, size_t size) {
+	if (size == 0) {
+		LOG_ERROR("sending packet to group failed: size is zero!");
+		return false;
+	}
+
+	if (_threaded) {
+		return thread_queue_send_group(ToxThreadSendPkg::GROUP, group_number, 0, lossless, mem, size);
+	}
+
+	return group_send_now(ToxThreadSendPkg::GROUP, group_number, 0, lossless, mem, size);
+}
+
+bool ToxService::group_send_packet_private(uint32_t group_number, uint32_t peer_id, bool lossless, const uint8_t* mem, size_t size) {
+	if (size == 0) {
+		LOG_ERROR("sending packet to group peer failed: size is zero!");
+		return false;
+	}
+
+	if (_threaded) {
+		return thread_queue_send_group(ToxThreadSendPkg::GROUP_PRIVATE, group_number, peer_id, lossless, mem, size);
+	}
+
+	return group_send_now(ToxThreadSendPkg::GROUP_PRIVATE, group_number, peer_id, lossless, mem, size);
+}
+
+bool ToxService::group_send_now(ToxThreadSendPkg::Target target, uint32_t group_number, uint32_t peer_id, bool lossless, const uint8_t* mem, size_t size) {
+	if (target == ToxThreadSendPkg::GROUP) {
+		Tox_Err_Group_Send_Custom_Packet err = TOX_ERR_GROUP_SEND_CUSTOM_PACKET_OK;
+		tox_group_send_custom_packet(_tox, group_number, lossless, mem, size, &err);
+		if (err != TOX_ERR_GROUP_SEND_CUSTOM_PACKET_OK) {
+			LOG_ERROR("sending packet to group {} failed with error code {}", group_number, err);
+			return false;
+		}
+	} else {
+		Tox_Err_Group_Send_Custom_Private_Packet err = TOX_ERR_GROUP_SEND_CUSTOM_PRIVATE_PACKET_OK;
+		tox_group_send_custom_private_packet(_tox, group_number, peer_id, lossless, mem, size, &err);
+		if (err != TOX_ERR_GROUP_SEND_CUSTOM_PRIVATE_PACKET_OK) {
+			LOG_ERROR("sending packet to group {} peer {} failed with error code {}", group_number, peer_id, err);
+			return false;
+		}
+	}
+
+	return true;
+}
+
 bool ToxService::group_send_message(uint32_t group_number, std::string_view msg) {
 	Tox_Err_Group_Send_Message err_group_send_m;
 
@@ -819,7 +1843,7 @@ static void friend_name_cb(Tox*, uint32_t friend_number, const uint8_t* name, si
 	LOGTOXCB("friend_name_cb");
 	auto* ts = static_cast<MM::Tox::Services::ToxService*>(user_data);
 
-	auto& f = ts->_tox_friends[friend_number];
+	auto& f = ts->_tox_friends_info[friend_number];
 	f.name.resize(length);
 	std::memcpy(f.name.data(), name, length);
 
@@ -830,7 +1854,7 @@ static void friend_status_message_cb(Tox*, uint32_t friend_number, const uint8_t
 	LOGTOXCB("friend_status_message_cb");
 	auto* ts = static_cast<MM::Tox::Services::ToxService*>(user_data);
 
-	auto& f = ts->_tox_friends[friend_number];
+	auto& f = ts->_tox_friends_info[friend_number];
 	f.status_msg.resize(length);
 	std::memcpy(f.status_msg.data(), message, length);
 }
@@ -839,7 +1863,7 @@ static void friend_status_cb(Tox*, uint32_t friend_number, TOX_USER_STATUS statu
 	LOGTOXCB("friend_status_cb");
 	auto* ts = static_cast<MM::Tox::Services::ToxService*>(user_data);
 
-	auto& f = ts->_tox_friends[friend_number];
+	auto& f = ts->_tox_friends_info[friend_number];
 	f.status = status;
 }
 
@@ -847,16 +1871,23 @@ static void friend_connection_status_cb(Tox*, uint32_t friend_number, TOX_CONNEC
 	LOGTOXCB("friend_connection_status_cb");
 	auto* ts = static_cast<MM::Tox::Services::ToxService*>(user_data);
 
-	auto& f = ts->_tox_friends[friend_number];
+	auto& f = ts->friend_mark_active(friend_number);
+	if ((connection_status == TOX_CONNECTION_NONE) != (f.connection_status == TOX_CONNECTION_NONE)) {
+		// a new session, udp <-> tcp keeps the handshake
+		f.connection_generation++;
+		f.__dirty = true;
+		f.caps = 0;
+		ts->_tox_friends_info[friend_number].hello = {};
+	}
 	f.connection_status = connection_status;
-	f.__dirty = true;
+	f.link.reset(connection_status == TOX_CONNECTION_UDP, std::chrono::steady_clock::now());
 }
 
 static void friend_typing_cb(Tox*, uint32_t friend_number, bool is_typing, void* user_data) {
 	LOGTOXCB("friend_typing_cb");
 	auto* ts = static_cast<MM::Tox::Services::ToxService*>(user_data);
 
-	auto& f = ts->_tox_friends[friend_number];
+	auto& f = ts->_tox_friends_info[friend_number];
 	f.typing = is_typing;
 }
 
@@ -886,7 +1917,7 @@ static void friend_message_cb(Tox*, uint32_t friend_number, TOX_MESSAGE_TYPE typ
 
 	auto* ts = static_cast<MM::Tox::Services::ToxService*>(user_data);
 
-	auto& f = ts->_tox_friends[friend_number];
+	auto& f = ts->_tox_friends_info[friend_number];
 	f.messages.emplace_back(false, type, std::string{reinterpret_cast<const char*>(message), length});
 }
 
@@ -975,11 +2006,11 @@ static void friend_lossy_packet_cb(Tox*, uint32_t friend_number, const uint8_t *
 
 	auto* ts = static_cast<MM::Tox::Services::ToxService*>(user_data);
 	// TODO: use toxext
-	//if (data[0] == MM_TOX_LOSSLESS_PKG_ID_INTERNAL) {
-		//ts->_tox_friends[friend_number].packets_internal.emplace_back(data, data+length);
-	//} else {
-		ts->_tox_friends[friend_number].packets.emplace_back(data, data+length);
-	//}
+	if (data[0] == MM_TOX_LOSSY_PKG_ID_INTERNAL) {
+		ts->friend_mark_active(friend_number).packets_internal.push(data, length);
+	} else {
+		ts->friend_mark_active(friend_number).packets.push(data, length);
+	}
 }
 
 static void friend_lossless_packet_cb(Tox*, uint32_t friend_number, const uint8_t *data, size_t length, void *user_data) {
@@ -987,14 +2018,16 @@ static void friend_lossless_packet_cb(Tox*, uint32_t friend_number, const uint8_
 
 	auto* ts = static_cast<MM::Tox::Services::ToxService*>(user_data);
 	if (data[0] == MM_TOX_LOSSLESS_PKG_ID_INTERNAL) {
-		ts->_tox_friends[friend_number].packets_lossless_internal.emplace_back(data, data+length);
+		ts->friend_mark_active(friend_number).packets_lossless_internal.push(data, length);
 	} else {
-		ts->_tox_friends[friend_number].packets_lossless.emplace_back(data, data+length);
+		ts->friend_mark_active(friend_number).packets_lossless.push(data, length);
 	}
 }
 
 static void group_peer_name_cb(Tox *tox, uint32_t group_number, uint32_t peer_id, const uint8_t *name, size_t length, void *user_data) {
 	LOGTOXCB("group_peer_name_cb");
+	DEFER_NGC(ToxGroupEvent::PEER_NAME, group_number, peer_id, 0, 0, {name, name+length});
+
 	auto* ts = static_cast<MM::Tox::Services::ToxService*>(user_data);
 	auto& group = ts->_tox_groups[group_number];
 
@@ -1004,6 +2037,8 @@ static void group_peer_name_cb(Tox *tox, uint32_t group_number, uint32_t peer_id
 
 static void group_peer_status_cb(Tox *tox, uint32_t group_number, uint32_t peer_id, Tox_User_Status status, void *user_data) {
 	LOGTOXCB("group_peer_status_cb");
+	DEFER_NGC(ToxGroupEvent::PEER_STATUS, group_number, peer_id, uint32_t(status));
+
 	auto* ts = static_cast<MM::Tox::Services::ToxService*>(user_data);
 	auto& group = ts->_tox_groups[group_number];
 
@@ -1013,6 +2048,8 @@ static void group_peer_status_cb(Tox *tox, uint32_t group_number, uint32_t peer_
 
 static void group_topic_cb(Tox *tox, uint32_t group_number, uint32_t peer_id, const uint8_t *topic, size_t length, void *user_data) {
 	LOGTOXCB("group_topic_cb");
+	DEFER_NGC(ToxGroupEvent::TOPIC, group_number, peer_id, 0, 0, {topic, topic+length});
+
 	auto* ts = static_cast<MM::Tox::Services::ToxService*>(user_data);
 	auto& group = ts->_tox_groups[group_number];
 
@@ -1024,6 +2061,8 @@ static void group_topic_cb(Tox *tox, uint32_t group_number, uint32_t peer_id, co
 
 static void group_privacy_state_cb(Tox *tox, uint32_t group_number, Tox_Group_Privacy_State privacy_state, void *user_data) {
 	LOGTOXCB("group_privacy_state_cb");
+	DEFER_NGC(ToxGroupEvent::PRIVACY_STATE, group_number, 0, uint32_t(privacy_state));
+
 	auto* ts = static_cast<MM::Tox::Services::ToxService*>(user_data);
 	auto& group = ts->_tox_groups[group_number];
 
@@ -1035,6 +2074,8 @@ static void group_privacy_state_cb(Tox *tox, uint32_t group_number, Tox_Group_Pr
 
 static void group_voice_state_cb(Tox *tox, uint32_t group_number, Tox_Group_Voice_State voice_state, void *user_data) {
 	LOGTOXCB("group_voice_state_cb");
+	DEFER_NGC(ToxGroupEvent::VOICE_STATE, group_number, 0, uint32_t(voice_state));
+
 	auto* ts = static_cast<MM::Tox::Services::ToxService*>(user_data);
 	auto& group = ts->_tox_groups[group_number];
 
@@ -1046,6 +2087,8 @@ static void group_voice_state_cb(Tox *tox, uint32_t group_number, Tox_Group_Voic
 
 static void group_topic_lock_cb(Tox *tox, uint32_t group_number, Tox_Group_Topic_Lock topic_lock, void *user_data) {
 	LOGTOXCB("group_topic_lock_cb");
+	DEFER_NGC(ToxGroupEvent::TOPIC_LOCK, group_number, 0, uint32_t(topic_lock));
+
 	auto* ts = static_cast<MM::Tox::Services::ToxService*>(user_data);
 	auto& group = ts->_tox_groups[group_number];
 
@@ -1062,6 +2105,8 @@ static void group_topic_lock_cb(Tox *tox, uint32_t group_number, Tox_Group_Topic
 
 static void group_peer_limit_cb(Tox *tox, uint32_t group_number, uint32_t peer_limit, void *user_data) {
 	LOGTOXCB("group_peer_limit_cb");
+	DEFER_NGC(ToxGroupEvent::PEER_LIMIT, group_number, 0, peer_limit);
+
 	auto* ts = static_cast<MM::Tox::Services::ToxService*>(user_data);
 	auto& group = ts->_tox_groups[group_number];
 
@@ -1070,6 +2115,8 @@ static void group_peer_limit_cb(Tox *tox, uint32_t group_number, uint32_t peer_l
 
 static void group_password_cb(Tox *tox, uint32_t group_number, const uint8_t *password, size_t length, void *user_data) {
 	LOGTOXCB("group_password_cb");
+	DEFER_NGC(ToxGroupEvent::PASSWORD, group_number, 0, 0, 0, {password, password+length});
+
 	auto* ts = static_cast<MM::Tox::Services::ToxService*>(user_data);
 	auto& group = ts->_tox_groups[group_number];
 
@@ -1078,6 +2125,8 @@ static void group_password_cb(Tox *tox, uint32_t group_number, const uint8_t *pa
 
 static void group_message_cb(Tox *tox, uint32_t group_number, uint32_t peer_id, Tox_Message_Type type, const uint8_t *message, size_t length, uint32_t message_id, void *user_data) {
 	LOGTOXCB("group_message_cb");
+	DEFER_NGC(ToxGroupEvent::MESSAGE, group_number, peer_id, uint32_t(type), message_id, {message, message+length});
+
 	auto* ts = static_cast<MM::Tox::Services::ToxService*>(user_data);
 	auto& group = ts->_tox_groups[group_number];
 
@@ -1086,6 +2135,8 @@ static void group_message_cb(Tox *tox, uint32_t group_number, uint32_t peer_id,
 
 static void group_private_message_cb(Tox *tox, uint32_t group_number, uint32_t peer_id, Tox_Message_Type type, const uint8_t *message, size_t length, void *user_data) {
 	LOGTOXCB("group_private_message_cb");
+	DEFER_NGC(ToxGroupEvent::PRIVATE_MESSAGE, group_number, peer_id, uint32_t(type), 0, {message, message+length});
+
 	auto* ts = static_cast<MM::Tox::Services::ToxService*>(user_data);
 	auto& group = ts->_tox_groups[group_number];
 
@@ -1093,20 +2144,50 @@ static void group_private_message_cb(Tox *tox, uint32_t group_number, uint32_t p
 	group.messages.push_back({peer_id, type, std::string{reinterpret_cast<const char*>(message), length}});
 }
 
+static void group_custom_packet_any(MM::Tox::Services::ToxService* ts, uint32_t group_number, uint32_t peer_id, const uint8_t *data, size_t length) {
+	if (length == 0) {
+		return;
+	}
+
+	// do not bring back a peer that already left
+	auto* group = ts->_tox_groups.find(group_number);
+	auto* peer = group != nullptr ? group->peers.find(peer_id) : nullptr;
+	if (peer == nullptr) {
+		LOG_WARN("group custom packet from unknown peer {} in group {}", peer_id, group_number);
+		return;
+	}
+
+	if (!peer->packets.push(data, length)) {
+		LOG_ERROR("group custom packet too large ({} bytes)", length);
+		return;
+	}
+
+	if (!peer->__active) {
+		peer->__active = true;
+		ts->_tox_groups_active.push_back({group_number, peer_id});
+	}
+}
+
 static void group_custom_packet_cb(Tox *tox, uint32_t group_number, uint32_t peer_id, const uint8_t *data, size_t length, void *user_data) {
 	LOGTOXCB("group_custom_packet_cb");
+	DEFER_NGC(ToxGroupEvent::CUSTOM_PACKET, group_number, peer_id, 0, 0, {data, data+length});
+
 	auto* ts = static_cast<MM::Tox::Services::ToxService*>(user_data);
-	auto& group = ts->_tox_groups[group_number];
+	group_custom_packet_any(ts, group_number, peer_id, data, length);
 }
 
 static void group_custom_private_packet_cb(Tox *tox, uint32_t group_number, uint32_t peer_id, const uint8_t *data, size_t length, void *user_data) {
 	LOGTOXCB("group_custom_private_packet_cb");
+	DEFER_NGC(ToxGroupEvent::CUSTOM_PRIVATE_PACKET, group_number, peer_id, 0, 0, {data, data+length});
+
 	auto* ts = static_cast<MM::Tox::Services::ToxService*>(user_data);
-	auto& group = ts->_tox_groups[group_number];
+	group_custom_packet_any(ts, group_number, peer_id, data, length);
 }
 
 static void group_invite_cb(Tox *tox, uint32_t friend_number, const uint8_t *invite_data, size_t length, const uint8_t *group_name, size_t group_name_length, void *user_data) {
 	LOGTOXCB("group_invite_cb");
+	DEFER_NGC(ToxGroupEvent::INVITE, friend_number, 0, 0, 0, {invite_data, invite_data+length}, {group_name, group_name+group_name_length});
+
 	auto* ts = static_cast<MM::Tox::Services::ToxService*>(user_data);
 
 	std::string tox_name = ts->get_name();
@@ -1137,6 +2218,8 @@ static void group_invite_cb(Tox *tox, uint32_t friend_number, const uint8_t *inv
 
 static void group_peer_join_cb(Tox *tox, uint32_t group_number, uint32_t peer_id, void *user_data) {
 	LOGTOXCB("group_peer_join_cb");
+	DEFER_NGC(ToxGroupEvent::PEER_JOIN, group_number, peer_id);
+
 	auto* ts = static_cast<MM::Tox::Services::ToxService*>(user_data);
 	auto& group = ts->_tox_groups[group_number];
 
@@ -1158,6 +2241,8 @@ static void group_peer_join_cb(Tox *tox, uint32_t group_number, uint32_t peer_id
 
 static void group_peer_exit_cb(Tox *tox, uint32_t group_number, uint32_t peer_id, Tox_Group_Exit_Type exit_type, const uint8_t *name, size_t name_length, const uint8_t *part_message, size_t length, void *user_data) {
 	LOGTOXCB("group_peer_exit_cb");
+	DEFER_NGC(ToxGroupEvent::PEER_EXIT, group_number, peer_id, uint32_t(exit_type), 0, {name, name+name_length}, {part_message, part_message+length});
+
 	auto* ts = static_cast<MM::Tox::Services::ToxService*>(user_data);
 	auto& group = ts->_tox_groups[group_number];
 
@@ -1168,6 +2253,8 @@ static void group_peer_exit_cb(Tox *tox, uint32_t group_number, uint32_t peer_id
 
 static void group_self_join_cb(Tox *tox, uint32_t group_number, void *user_data) {
 	LOGTOXCB("group_self_join_cb");
+	DEFER_NGC(ToxGroupEvent::SELF_JOIN, group_number);
+
 	auto* ts = static_cast<MM::Tox::Services::ToxService*>(user_data);
 	auto& group = ts->_tox_groups[group_number];
 
@@ -1189,6 +2276,8 @@ static void group_self_join_cb(Tox *tox, uint32_t group_number, void *user_data)
 
 static void group_join_fail_cb(Tox *tox, uint32_t group_number, Tox_Group_Join_Fail fail_type, void *user_data) {
 	LOGTOXCB("group_join_fail_cb");
+	DEFER_NGC(ToxGroupEvent::JOIN_FAIL, group_number, 0, uint32_t(fail_type));
+
 	auto* ts = static_cast<MM::Tox::Services::ToxService*>(user_data);
 	auto& group = ts->_tox_groups[group_number];
 
@@ -1197,6 +2286,8 @@ static void group_join_fail_cb(Tox *tox, uint32_t group_number, Tox_Group_Join_F
 
 static void group_moderation_cb(Tox *tox, uint32_t group_number, uint32_t source_peer_id, uint32_t target_peer_id, Tox_Group_Mod_Event mod_type, void *user_data) {
 	LOGTOXCB("group_moderation_cb");
+	DEFER_NGC(ToxGroupEvent::MODERATION, group_number, source_peer_id, target_peer_id, uint32_t(mod_type));
+
 	auto* ts = static_cast<MM::Tox::Services::ToxService*>(user_data);
 	auto& group = ts->_tox_groups[group_number];
 
@@ -4,22 +4,43 @@
 
 // TODO: make tox.h private
 #include <tox.h>
+#include <mm_tox/utils/spsc_queue.hpp>
+#include <mm_tox/utils/mpsc_queue.hpp>
+#include <mm_tox/utils/save_writer.hpp>
+#include <mm_tox/utils/packet_ring.hpp>
+#include <mm_tox/utils/dense_table.hpp>
+#include <mm_tox/utils/link_estimator.hpp>
+
 #include <map>
 #include <deque>
+#include <memory>
+#include <chrono>
+#include <functional>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
 
 // fwd
 //typedef struct Tox Tox;
+typedef struct Tox_Events Tox_Events;
 
 namespace MM::Tox::Services {
 
 // the pkg id for "internal" pkgs
-//#define MM_TOX_LOSSY_PKG_ID_INTERNAL 1900000
+#define MM_TOX_LOSSY_PKG_ID_INTERNAL 254
 #define MM_TOX_LOSSLESS_PKG_ID_INTERNAL 160
 
+// sent with MM_HELLO, bump on incompatible changes to the internal pkgs
+#define MM_TOX_PROTOCOL_VERSION 1
+// sent with MM_HELLO, bump on changes to the ToxNetChanneled/ToxGroupNetChanneled pkg layout.
+// 0 (no MM_HELLO): large packets as 1 (part) and 2 (last part), 1: with msg id and size, see ToxChanneledPkg
+#define MM_TOX_FRAMING_VERSION 1
+
 // please keep this updated
 enum ToxInternalPkgID : uint8_t {
-	MM_INSTANCE = 0u,			// tell someone, that you are a MushMachine instance
-	MM_APP,						// after knowing the other is mm instance, tell you app string (eg "gh4nr-prot3")
+	MM_INSTANCE = 0u,			// legacy, magic (8). only sent back to peers that send it without MM_HELLO
+	MM_APP,						// legacy, app string zero padded to 254 bytes. sent along with MM_INSTANCE
 
 	TOX_LOBBY_PUBLIC_INFO1,		// tell others, u have a open lobby (not just rp)
 	TOX_LOBBY_INVITE1,			// tell others to join your lobby (aka private_info)
@@ -28,9 +49,31 @@ enum ToxInternalPkgID : uint8_t {
 	TOX_LOBBY_LEAVE,			// tell host u leave, or host tells you to
 	TOX_LOBBY_PING,				// sent by the host in a fixed interval, client has to respond
 
+	LINK_PING,					// lossy, seq + sender timestamp, for rtt and loss
+	LINK_PONG,					// lossy, the ping echoed back + the responder's wall clock
+
+	MM_HELLO,					// once per connection, tell someone, that you are a MushMachine instance, and what you support
+
 	ToxInternalPkgID_MAX		// used for undefined (error)
 };
 
+// MM_HELLO: magic (8), then entries of type (1), length (1), value (length bytes), little endian.
+// unknown types are skipped, so new ones can be added without a version bump
+enum ToxHelloType : uint8_t {
+	HELLO_PROTOCOL_VERSION = 0u,	// u16, MM_TOX_PROTOCOL_VERSION
+	HELLO_APP,						// app string (eg "gh4nr-prot3"), up to 255 bytes
+	HELLO_CAPS,						// u32, ToxCaps bits
+	HELLO_FRAMING_VERSION,			// u8, MM_TOX_FRAMING_VERSION
+	HELLO_LZ_DICT,					// u32, id of the compression dictionaries, only sent if there are any
+};
+
+// HELLO_CAPS bits
+enum ToxCaps : uint32_t {
+	CAP_LZ = 1u << 0,			// ToxNetChanneled: compressed payloads (LZCodec)
+	CAP_BATCH = 1u << 1,		// ToxNetChanneled: PKG_BATCH
+	CAP_RELIABLE = 1u << 2,		// ToxNetChanneled: reliable-over-lossy (tox_reliable_wire_id)
+};
+
 class ToxService : public MM::Services::Service {
 	// callbacks need public
 	public:
@@ -40,14 +83,86 @@ class ToxService : public MM::Services::Service {
 
 		struct Tox* _tox {nullptr};
 
-		bool _state_dirty {false}; // true causes update_savefile() after iterate
+		bool _state_dirty {false}; // true causes update_savefile() after iterate, at most once per _save_interval
 
+		// dirty state is coalesced into one write per interval
+		std::chrono::steady_clock::duration _save_interval {std::chrono::seconds(2)};
+
+		// threaded mode: a worker thread owns tox_iterate() and hands events to iterate() through lock-free queues
+		// NOTE: set before enable()
+		bool _threaded {false};
+
+		// batched mode: iterate() gets one tox_events batch per tick and applies it grouped by friend
+		// threaded mode is always batched
+		// NOTE: set before enable()
+		bool _batched_events {false};
+
+		// if set, gets every batch serialized (tox_events_get_bytes()) before it is applied, see replay_events()
+		// NOTE: ngc events are not part of tox_events yet, so they are not recorded
+		std::function<void(const uint8_t* data, size_t size)> _events_record_fn;
+
+		// touched every tick (packets, connection), kept apart from the rest
 		struct ToxFriend {
 			bool __dirty {true}; // used for sending internal state
+			bool __active {false}; // in _tox_friends_active
 			bool mm_instance {false};
-			std::string mm_app;
 
 			Tox_Connection connection_status {TOX_CONNECTION_NONE};
+			// bumped when the friend goes offline or comes online, per friend protocol state starts over
+			uint32_t connection_generation {0};
+
+			// cleared every tick, slots get reused
+			PacketRing packets {tox_max_custom_packet_size()};
+			PacketRing packets_lossless {tox_max_custom_packet_size()};
+			PacketRing packets_internal {tox_max_custom_packet_size()};
+			PacketRing packets_lossless_internal {tox_max_custom_packet_size()};
+
+			// outgoing lossless packets toxcore did not take yet (SENDQ), in order
+			PacketRing sendq {tox_max_custom_packet_size()};
+			size_t sendq_high_water {0};
+			bool __in_sendq {false}; // in _tox_friends_sendq
+
+			LinkEstimator link;
+			uint16_t link_ping_seq {0};
+
+			uint32_t caps {0}; // ToxCaps the friend sent with MM_HELLO, reset on connection change
+		};
+		DenseTable<ToxFriend> _tox_friends; // friend_number
+
+		// friends that had traffic or a state change this tick, reset in pkg_cleanup()
+		std::vector<uint32_t> _tox_friends_active;
+
+		// creates the friend if missing
+		ToxFriend& friend_mark_active(uint32_t friend_number);
+
+		// friends with a non empty sendq, retried every iterate()
+		std::vector<uint32_t> _tox_friends_sendq;
+
+		// per friend, lossless sends beyond this fail
+		size_t _sendq_max_packets {1u << 14};
+		// drained sendqs keep at most this many slots
+		static constexpr size_t sendq_keep_slots = 64;
+
+		// ToxCaps we announce with MM_HELLO
+		uint32_t _caps {0};
+		// HELLO_LZ_DICT we announce, 0 for none
+		uint32_t _lz_dict_id {0};
+
+		// connected mm instances get pinged this often, see LinkEstimator
+		std::chrono::steady_clock::duration _link_ping_interval {std::chrono::seconds(1)};
+		std::chrono::steady_clock::time_point _link_ping_last {};
+
+		// the rest of a friend's MM_HELLO, caps are in ToxFriend
+		struct ToxHello {
+			uint16_t protocol_version {0}; // 0 if none received (since the last connection change)
+			uint8_t framing_version {0};
+			uint32_t lz_dict_id {0}; // 0 if none
+		};
+
+		// rarely touched, same index as _tox_friends
+		struct ToxFriendInfo {
+			std::string mm_app;
+			ToxHello hello;
 
 			std::string name;
 			std::string status_msg;
@@ -56,24 +171,19 @@ class ToxService : public MM::Services::Service {
 			bool typing {false};
 
 			std::vector<std::tuple<bool, Tox_Message_Type, std::string>> messages; // self, msg_type, msg
-
-			std::deque<std::vector<uint8_t>> packets;
-			std::deque<std::vector<uint8_t>> packets_lossless;
-			std::deque<std::vector<uint8_t>> packets_internal;
-			std::deque<std::vector<uint8_t>> packets_lossless_internal;
 		};
-		std::map<uint32_t, ToxFriend> _tox_friends; // friend_number
+		DenseTable<ToxFriendInfo> _tox_friends_info; // friend_number
 
 		struct ToxConference {
 			Tox_Conference_Type type;
 			std::string title;
 
-			std::map<uint32_t, std::string> peers; // peer_number, name
+			DenseTable<std::string> peers; // peer_number, name
 			std::vector<std::tuple<uint32_t, Tox_Message_Type, std::string>> messages; // peer_number, msg_type, msg
 
 			// sadly no custom packet support yet -> see groups
 		};
-		std::map<uint32_t, ToxConference> _tox_conferences; // conference_number
+		DenseTable<ToxConference> _tox_conferences; // conference_number
 
 		// "NGC"
 		struct ToxGroup {
@@ -89,12 +199,19 @@ class ToxService : public MM::Services::Service {
 				Tox_User_Status status;
 				// public key
 				// connection type (nah, just query)
+
+				// custom packets this tick, group wide and private, slots get reused
+				PacketRing packets {tox_group_max_custom_lossless_packet_length()};
+				bool __active {false}; // in _tox_groups_active
 			};
-			std::map<uint32_t, Peer> peers; // peer_number
+			SlotTable<Peer> peers; // peer_id, not a small number
 
 			std::vector<std::tuple<uint32_t, Tox_Message_Type, std::string>> messages; // peer_id, msg_type, msg
 		};
-		std::map<uint32_t, ToxGroup> _tox_groups; // group_number
+		DenseTable<ToxGroup> _tox_groups; // group_number
+
+		// group peers with custom packets this tick (group_number, peer_id), reset in pkg_cleanup()
+		std::vector<std::pair<uint32_t, uint32_t>> _tox_groups_active;
 
 		// TODO: implement reciept
 		//struct ToxFriendMessage {
@@ -104,9 +221,56 @@ class ToxService : public MM::Services::Service {
 		//};
 		//std::map<uint32_t, std::vector<ToxFriendMessage>> _tox_friend_msgs;
 
+		// ngc events recorded during tox_events_iterate(), applied by iterate() after the batch they came with
+		// (tox_events does not cover ngc yet)
+		struct ToxGroupEvent {
+			enum Type : uint8_t {
+				PEER_NAME,
+				PEER_STATUS,
+				TOPIC,
+				PRIVACY_STATE,
+				VOICE_STATE,
+				TOPIC_LOCK,
+				PEER_LIMIT,
+				PASSWORD,
+				MESSAGE,
+				PRIVATE_MESSAGE,
+				CUSTOM_PACKET,
+				CUSTOM_PRIVATE_PACKET,
+				INVITE,
+				PEER_JOIN,
+				PEER_EXIT,
+				SELF_JOIN,
+				JOIN_FAIL,
+				MODERATION,
+			} type {PEER_NAME};
+
+			uint32_t group_number {0}; // friend_number for INVITE
+			uint32_t peer_id {0}; // source peer for MODERATION
+			uint32_t value {0}; // enums, peer limit, target peer
+			uint32_t value2 {0}; // message id, mod event
+
+			std::vector<uint8_t> data;
+			std::vector<uint8_t> data2;
+
+			ToxGroupEvent(void) = default;
+			ToxGroupEvent(
+				Type type_, uint32_t group_number_,
+				uint32_t peer_id_ = 0, uint32_t value_ = 0, uint32_t value2_ = 0,
+				std::vector<uint8_t> data_ = {}, std::vector<uint8_t> data2_ = {}
+			) :
+				type(type_), group_number(group_number_),
+				peer_id(peer_id_), value(value_), value2(value2_),
+				data(std::move(data_)), data2(std::move(data2_))
+			{}
+		};
+
+		// only called from the thread running tox_events_iterate(), never blocks or drops (toxcore holds its lock)
+		void record_group_event(ToxGroupEvent&& e);
+
 	public:
 		ToxService(void);
-		ToxService(Engine& engine, const std::string& path_to_toxsave);
+		ToxService(Engine& engine, const std::string& path_to_toxsave, bool threaded = false);
 
 		const char* name(void) override { return "ToxService"; }
 
@@ -117,10 +281,110 @@ class ToxService : public MM::Services::Service {
 		void iterate(Engine& engine);
 		void pkg_cleanup(Engine& engine);
 
+	protected: // batched events
+		bool events_batched(void) const { return _threaded || _batched_events; }
+
+		// recorded by whoever runs tox_events_iterate(), worker or tick, handed over with that batch
+		std::vector<ToxGroupEvent> _group_events_recording;
+
+		// one tox_events_iterate(), events is null if only ngc events happend
+		struct ToxEventBatch {
+			Tox_Events* events {nullptr};
+			std::vector<ToxGroupEvent> group_events;
+		};
+
+		// reused every batch, to group friend events by friend
+		struct ToxFriendEventRef {
+			uint32_t friend_number;
+			uint8_t kind; // also the order they get applied in
+			uint32_t index;
+		};
+		std::vector<ToxFriendEventRef> _events_friend_scratch;
+
+		void apply_events(const Tox_Events* events);
+		void apply_group_events(std::vector<ToxGroupEvent>& group_events);
+
+	public:
+		// applies a previously recorded batch, as if tox just produced it
+		bool replay_events(const uint8_t* data, size_t size);
+
 	protected:
 		std::string _own_tox_id_stringyfied;
 
+	protected: // threaded mode
+		struct ToxThreadSendPkg {
+			uint32_t friend_number {0}; // group_number for group packets
+			bool lossless {false};
+			std::vector<uint8_t> data;
+
+			enum Target : uint8_t {
+				FRIEND,
+				GROUP,
+				GROUP_PRIVATE,
+			} target {FRIEND};
+			uint32_t group_peer_id {0}; // GROUP_PRIVATE
+		};
+
+		std::thread _thread;
+		std::atomic_bool _thread_quit {false};
+
+		// only used to sleep/wake the worker, the queues themselves are lock-free
+		std::mutex _thread_wake_mutex;
+		std::condition_variable _thread_wake_cv;
+
+		SPSCQueue<ToxEventBatch> _thread_events_queue {1024}; // worker -> iterate()
+		// friend_send_packet*(), group_send_packet*() and link_ping() may run from any engine task, so multi producer
+		MPSCQueue<ToxThreadSendPkg> _thread_send_queue {4096}; // iterate()/game -> worker
+
+		// worker only, lossless packets toxcore did not take yet (SENDQ), in order per friend
+		struct ThreadSendq {
+			PacketRing packets {tox_max_custom_packet_size()};
+			bool __in_list {false}; // in _thread_sendq_friends
+		};
+		DenseTable<ThreadSendq> _thread_sendq; // friend_number
+		std::vector<uint32_t> _thread_sendq_friends; // with packets queued, retried every worker iteration
+		// mirrored per friend for the tick side, updated by the worker after each flush
+		struct ThreadSendqStats {
+			size_t size {0};
+			size_t high_water {0};
+		};
+		mutable std::mutex _thread_sendq_stats_mutex;
+		DenseTable<ThreadSendqStats> _thread_sendq_stats; // friend_number, only friends that hit SENDQ
+
+		void thread_main(void);
+		void thread_start(void);
+		void thread_stop(void);
+
+		bool thread_queue_send(uint32_t friend_number, bool lossless, const uint8_t* mem, size_t size);
+		bool thread_queue_send_group(ToxThreadSendPkg::Target target, uint32_t group_number, uint32_t peer_id, bool lossless, const uint8_t* mem, size_t size);
+		// sends right away, toxcore has no SENDQ for groups
+		bool group_send_now(ToxThreadSendPkg::Target target, uint32_t group_number, uint32_t peer_id, bool lossless, const uint8_t* mem, size_t size);
+		void thread_flush_sendq(void);
+		void thread_drain(void);
+
+	protected: // sendq
+		bool sendq_push(uint32_t friend_number, const uint8_t* mem, size_t size);
+		void sendq_flush(void);
+
+	protected: // link estimation
+		void link_handle_internal(uint32_t friend_number, ToxFriend& f);
+		void link_ping(void);
+
+	protected: // handshake (MM_HELLO, then MM_INSTANCE and MM_APP for older peers)
+		void send_hello(uint32_t friend_number);
+		// after something we announce changed
+		void resend_hello(void);
+		// MM_INSTANCE + MM_APP, for peers from before MM_HELLO
+		void send_hello_legacy(uint32_t friend_number);
+		void handle_hello(uint32_t friend_number, ToxFriend& f, const PacketView& pk);
+
+	protected: // savefile
+		std::unique_ptr<SaveWriter> _save_writer; // null without a savefile path (and outside of enable/disable)
+		std::vector<uint8_t> _save_snapshot; // reused
+		std::chrono::steady_clock::time_point _save_last {};
+
 	public:
+		// snapshots the savedata and hands it to the writer, the actual write happens in the background
 		void update_savefile(Engine& engine);
 
 		const std::string& get_own_tox_id_string(void) { return _own_tox_id_stringyfied; }
@@ -135,9 +399,38 @@ class ToxService : public MM::Services::Service {
 		bool broadcast_message(std::string_view msg);
 
 		// send a packet (raw data, tox cust. packs.) to a friend
+		// lossless packets toxcore can not take right now (SENDQ) are queued and retried, in order.
+		// false means the packet is lost (error, or the sendq is full)
 		bool friend_send_packet(uint32_t friend_number, uint8_t* mem, size_t size);
 		bool friend_send_packet_lossless(uint32_t friend_number, uint8_t* mem, size_t size);
 
+		// lossless packets waiting for toxcore
+		// NOTE: in threaded mode, as last reported by the worker
+		size_t friend_sendq_size(uint32_t friend_number) const;
+		size_t friend_sendq_high_water(uint32_t friend_number) const;
+		// how many more packets can be queued, before sending fails
+		// NOTE: in threaded mode, also limited by the queue to the worker, which all friends share
+		size_t friend_sendq_space(uint32_t friend_number) const;
+
+		// rtt, jitter, loss, clock offset, send rate, nullptr if unknown friend
+		const LinkEstimator* friend_link(uint32_t friend_number) const;
+		// recommended bytes/s, lossy traffic should stay below this
+		size_t friend_send_budget(uint32_t friend_number) const;
+
+		// what we announce, changes get resent to everyone
+		void caps_set(uint32_t caps);
+		uint32_t caps_get(void) const { return _caps; }
+		// same, for the compression dictionaries (ToxNetChanneled), 0 for none
+		void lz_dict_id_set(uint32_t id);
+		// what the friend announced, 0 if not (yet) known
+		uint32_t friend_caps(uint32_t friend_number) const;
+		// what both announced
+		uint32_t friend_caps_common(uint32_t friend_number) const { return friend_caps(friend_number) & _caps; }
+		// nullptr if no MM_HELLO was received since the last connection change
+		const ToxHello* friend_hello(uint32_t friend_number) const;
+		// MM_TOX_FRAMING_VERSION of the friend, 0 for peers without MM_HELLO (the old framing) or not known yet
+		uint8_t friend_framing_version(uint32_t friend_number) const;
+
 		// send a packet to all your friends
 		bool broadcast_packet(uint8_t* mem, size_t size);
 		bool broadcast_packet_lossless(uint8_t* mem, size_t size);
@@ -148,52 +441,74 @@ class ToxService : public MM::Services::Service {
 		// send a message to a group
 		bool group_send_message(uint32_t group_number, std::string_view msg);
 
+		// send a custom packet to everyone in the group, relayed by the group, no friendship needed.
+		// lossless ones arrive in order, lossy ones are smaller (tox_group_max_custom_lossy_packet_length())
+		bool group_send_packet(uint32_t group_number, bool lossless, const uint8_t* mem, size_t size);
+		// to a single peer of the group
+		bool group_send_packet_private(uint32_t group_number, uint32_t peer_id, bool lossless, const uint8_t* mem, size_t size);
+
 		std::string get_name(void);
 		bool set_name(std::string_view new_name);
 		bool set_status(std::string_view new_status);
 
 	private:
 		// internal helper
-		template<typename T, typename Fn>
-		void __each_packet_fren(T& list, Fn&& fn) {
-			for (std::vector<uint8_t>& vec : list) {
-				fn(vec);
-			}
+		template<typename Fn>
+		void __each_packet_fren(PacketRing& list, Fn&& fn) {
+			list.each(fn);
 		}
 
 		// internal helper
 		template<typename CGetFn, typename Fn>
 		void __each_packet_any(CGetFn&& container_getter_fn, Fn&& fn) {
-			for (auto& [f_id, f] : _tox_friends) {
-				for (std::vector<uint8_t>& vec : container_getter_fn(f)) {
-					fn(f_id, vec);
-				}
+			// only active friends can have packets
+			for (const uint32_t f_id : _tox_friends_active) {
+				container_getter_fn(_tox_friends.at(f_id)).each([&fn, f_id](PacketView& view) {
+					fn(f_id, view);
+				});
 			}
 		}
 
 	public:
 		template<typename Fn>
 		void friend_packet_each(uint32_t friend_number, Fn&& fn) {
-			if (!_tox_friends.count(friend_number)) { return; }
-			__each_packet_fren(_tox_friends[friend_number].packets, fn);
+			auto* f = _tox_friends.find(friend_number);
+			if (f == nullptr) { return; }
+			__each_packet_fren(f->packets, fn);
 		}
 
 		template<typename Fn>
 		void friend_packet_each_lossless(uint32_t friend_number, Fn&& fn) {
-			if (!_tox_friends.count(friend_number)) { return; }
-			__each_packet_fren(_tox_friends[friend_number].packets_lossless, fn);
+			auto* f = _tox_friends.find(friend_number);
+			if (f == nullptr) { return; }
+			__each_packet_fren(f->packets_lossless, fn);
 		}
 
 		template<typename Fn>
 		void friend_packet_each_lossless_internal(uint32_t friend_number, Fn&& fn) {
-			if (!_tox_friends.count(friend_number)) { return; }
-			__each_packet_fren(_tox_friends[friend_number].packets_lossless_internal, fn);
+			auto* f = _tox_friends.find(friend_number);
+			if (f == nullptr) { return; }
+			__each_packet_fren(f->packets_lossless_internal, fn);
+		}
+
+		// custom packets from group peers this tick, fn(group_number, peer_id, PacketView&)
+		template<typename Fn>
+		void group_packet_each(Fn&& fn) {
+			for (const auto& [group_number, peer_id] : _tox_groups_active) {
+				auto* group = _tox_groups.find(group_number);
+				if (group == nullptr) { continue; }
+				auto* peer = group->peers.find(peer_id);
+				if (peer == nullptr) { continue; } // left this tick
+				peer->packets.each([&fn, group_number = group_number, peer_id = peer_id](PacketView& view) {
+					fn(group_number, peer_id, view);
+				});
+			}
 		}
 
 		template<typename Fn>
 		void any_packet_each(Fn&& fn) {
 			__each_packet_any(
-				[](auto& f) { return f.packets; },
+				[](auto& f) -> PacketRing& { return f.packets; },
 				fn
 			);
 		}
@@ -201,7 +516,7 @@ class ToxService : public MM::Services::Service {
 		template<typename Fn>
 		void any_packet_each_lossless(Fn&& fn) {
 			__each_packet_any(
-				[](auto& f) { return f.packets_lossless; },
+				[](auto& f) -> PacketRing& { return f.packets_lossless; },
 				fn
 			);
 		}
@@ -209,7 +524,7 @@ class ToxService : public MM::Services::Service {
 		template<typename Fn>
 		void any_packet_each_lossless_internal(Fn&& fn) {
 			__each_packet_any(
-				[](auto& f) { return f.packets_lossless_internal; },
+				[](auto& f) -> PacketRing& { return f.packets_lossless_internal; },
 				fn
 			);
 		}
@@ -0,0 +1,106 @@
+#pragma once
+
+#include <mm/services/net_channeled_interface.hpp>
+
+#include <array>
+#include <cstdint>
+#include <cstddef>
+
+namespace MM::Tox {
+
+// first bytes toxcore allows for custom packets, minus the ones ToxService keeps for itself
+constexpr uint8_t tox_lossless_channel_first = 161; // 160 is MM_TOX_LOSSLESS_PKG_ID_INTERNAL
+constexpr uint8_t tox_lossless_channel_last = 191;
+constexpr uint8_t tox_lossy_channel_first = 192;
+constexpr uint8_t tox_lossy_channel_last = 252;
+constexpr uint8_t tox_reliable_wire_id = 253; // all reliable-over-lossy channels, the channel is in the packet
+// 254 is MM_TOX_LOSSY_PKG_ID_INTERNAL
+
+constexpr size_t tox_max_lossless_channels = tox_lossless_channel_last - tox_lossless_channel_first + 1;
+constexpr size_t tox_max_lossy_channels = tox_lossy_channel_last - tox_lossy_channel_first + 1;
+constexpr size_t tox_max_channels = tox_max_lossless_channels + tox_max_lossy_channels;
+
+// maps channels to the first byte on the wire and back, by table lookup.
+// lossless and lossy channels are numbered separately within their wire range, in channel order.
+// except for layouts from legacy(), which keep the old 161+channel / 192+channel ids.
+struct ToxChannelTable {
+	using channel_type = MM::Services::NetChanneledInterface::channel_type;
+	using channel_id = MM::Services::NetChanneledInterface::channel_id;
+
+	static constexpr channel_id invalid = 0xff;
+
+	size_t count {0};
+	std::array<channel_type, tox_max_channels> type {};
+	std::array<uint8_t, tox_max_channels> wire_id {};
+	std::array<channel_id, 256> channel_of {}; // wire_id -> channel, invalid if none
+
+	constexpr ToxChannelTable(void) {
+		for (auto& c : channel_of) {
+			c = invalid;
+		}
+	}
+
+	template<size_t N>
+	constexpr explicit ToxChannelTable(const std::array<channel_type, N>& types) : ToxChannelTable() {
+		size_t lossless_next = tox_lossless_channel_first;
+		size_t lossy_next = tox_lossy_channel_first;
+
+		static_assert(N <= tox_max_channels);
+		for (size_t i = 0; i < N; i++) {
+			const size_t id = types[i] == channel_type::LOSSLESS ? lossless_next++ : lossy_next++;
+
+			type[i] = types[i];
+			wire_id[i] = static_cast<uint8_t>(id);
+			channel_of[id] = static_cast<channel_id>(i);
+			count = i + 1;
+		}
+
+		if (lossless_next - 1 > tox_lossless_channel_last || lossy_next - 1 > tox_lossy_channel_last) {
+			count = 0; // not valid()
+		}
+	}
+
+	// the mapping from before ToxChannels, wire id is the first id of the type + the channel index.
+	// the all lossless default maps the same either way, mixed layouts only agree with this one
+	template<size_t N>
+	static constexpr ToxChannelTable legacy(const std::array<channel_type, N>& types) {
+		ToxChannelTable table;
+
+		static_assert(N <= tox_max_lossless_channels);
+		for (size_t i = 0; i < N; i++) {
+			const size_t id = (types[i] == channel_type::LOSSLESS ? tox_lossless_channel_first : tox_lossy_channel_first) + i;
+
+			table.type[i] = types[i];
+			table.wire_id[i] = static_cast<uint8_t>(id);
+			table.channel_of[id] = static_cast<channel_id>(i);
+			table.count = i + 1;
+		}
+
+		return table;
+	}
+
+	// false if there were more channels of a type, than that type has ids
+	constexpr bool valid(void) const { return count > 0; }
+
+	constexpr bool lossless(channel_id channel) const { return type[channel] == channel_type::LOSSLESS; }
+};
+
+// compile time checked channel layout, eg:
+// ToxNetChanneled{ToxChannels<channel_type::LOSSLESS, channel_type::LOSSY, ...>{}}
+template<MM::Services::NetChanneledInterface::channel_type... Types>
+struct ToxChannels {
+	using channel_type = MM::Services::NetChanneledInterface::channel_type;
+
+	static constexpr size_t count = sizeof...(Types);
+	static constexpr size_t lossless_count = ((Types == channel_type::LOSSLESS ? 1 : 0) + ... + 0);
+	static constexpr size_t lossy_count = count - lossless_count;
+
+	static_assert(count > 0, "need at least one channel");
+	static_assert(lossless_count <= tox_max_lossless_channels, "too many lossless channels, toxcore only has 161-191");
+	static_assert(lossy_count <= tox_max_lossy_channels, "too many lossy channels, toxcore only has 192-252 left");
+
+	static constexpr ToxChannelTable table {std::array<channel_type, count>{Types...}};
+	static_assert(table.valid());
+};
+
+} // MM::Tox
@@ -0,0 +1,207 @@
+#pragma once
+
+#include <vector>
+#include <unordered_map>
+#include <cstdint>
+#include <cstddef>
+#include <cassert>
+
+namespace MM::Tox {
+
+// map like entry, as returned by iterating the tables below
+template<typename T>
+struct DenseTableEntry {
+	const uint32_t first; // id
+	T& second;
+};
+
+template<typename Table, typename T>
+class DenseTableIterator {
+	private:
+		Table* _table {nullptr};
+		size_t _slot {0};
+
+		void skip_dead(void) {
+			while (_slot < _table->slot_count() && !_table->slot_alive(_slot)) {
+				_slot++;
+			}
+		}
+
+	public:
+		DenseTableIterator(Table* table, size_t slot) : _table(table), _slot(slot) { skip_dead(); }
+
+		DenseTableEntry<T> operator*(void) const { return {_table->slot_id(_slot), _table->slot_value(_slot)}; }
+
+		DenseTableIterator& operator++(void) {
+			_slot++;
+			skip_dead();
+			return *this;
+		}
+
+		bool operator==(const DenseTableIterator& other) const { return _slot == other._slot; }
+		bool operator!=(const DenseTableIterator& other) const { return _slot != other._slot; }
+};
+
+// dense storage for things toxcore numbers itself (friend_number, group_number, ...).
+// those numbers are small and get reused, so they index a plain array directly.
+// NOTE: like std::vector, operator[] on a new id may invalidate references
+template<typename T>
+class DenseTable {
+	private:
+		std::vector<T> _values;
+		std::vector<uint8_t> _alive;
+		size_t _size {0};
+
+	public:
+		using iterator = DenseTableIterator<DenseTable<T>, T>;
+		using const_iterator = DenseTableIterator<const DenseTable<T>, const T>;
+
+		// creates if missing
+		T& operator[](uint32_t id) {
+			if (id >= _values.size()) {
+				_values.resize(id + 1);
+				_alive.resize(id + 1, false);
+			}
+			if (!_alive[id]) {
+				_alive[id] = true;
+				_size++;
+			}
+			return _values[id];
+		}
+
+		bool contains(uint32_t id) const { return id < _alive.size() && _alive[id]; }
+		size_t count(uint32_t id) const { return contains(id) ? 1 : 0; }
+
+		// nullptr if missing, never creates
+		T* find(uint32_t id) { return contains(id) ? &_values[id] : nullptr; }
+		const T* find(uint32_t id) const { return contains(id) ? &_values[id] : nullptr; }
+
+		T& at(uint32_t id) { assert(contains(id)); return _values[id]; }
+		const T& at(uint32_t id) const { assert(contains(id)); return _values[id]; }
+
+		void erase(uint32_t id) {
+			if (!contains(id)) {
+				return;
+			}
+			_values[id] = T{};
+			_alive[id] = false;
+			_size--;
+		}
+
+		void clear(void) {
+			_values.clear();
+			_alive.clear();
+			_size = 0;
+		}
+
+		size_t size(void) const { return _size; }
+		bool empty(void) const { return _size == 0; }
+
+		iterator begin(void) { return {this, 0}; }
+		iterator end(void) { return {this, _values.size()}; }
+		const_iterator begin(void) const { return {this, 0}; }
+		const_iterator end(void) const { return {this, _values.size()}; }
+
+	public: // for the iterator
+		size_t slot_count(void) const { return _values.size(); }
+		bool slot_alive(size_t slot) const { return _alive[slot]; }
+		uint32_t slot_id(size_t slot) const { return static_cast<uint32_t>(slot); }
+		T& slot_value(size_t slot) { return _values[slot]; }
+		const T& slot_value(size_t slot) const { return _values[slot]; }
+};
+
+// dense storage for ids that are not small (eg. ngc peer_id).
+// values live in a packed slot array, freed slots are reused through a free list.
+// NOTE: like std::vector, operator[] on a new id may invalidate references
+template<typename T>
+class SlotTable {
+	private:
+		std::vector<T> _values;
+		std::vector<uint32_t> _ids;
+		std::vector<uint8_t> _alive;
+		std::vector<uint32_t> _free_slots;
+		std::unordered_map<uint32_t, uint32_t> _slot_of; // id -> slot
+
+	public:
+		using iterator = DenseTableIterator<SlotTable<T>, T>;
+		using const_iterator = DenseTableIterator<const SlotTable<T>, const T>;
+
+		// creates if missing
+		T& operator[](uint32_t id) {
+			if (auto it = _slot_of.find(id); it != _slot_of.end()) {
+				return _values[it->second];
+			}
+
+			uint32_t slot = 0;
+			if (!_free_slots.empty()) {
+				slot = _free_slots.back();
+				_free_slots.pop_back();
+			} else {
+				slot = static_cast<uint32_t>(_values.size());
+				_values.emplace_back();
+				_ids.emplace_back();
+				_alive.emplace_back();
+			}
+
+			_ids[slot] = id;
+			_alive[slot] = true;
+			_slot_of[id] = slot;
+
+			return _values[slot];
+		}
+
+		bool contains(uint32_t id) const { return _slot_of.count(id); }
+		size_t count(uint32_t id) const { return _slot_of.count(id); }
+
+		// nullptr if missing, never creates
+		T* find(uint32_t id) {
+			auto it = _slot_of.find(id);
+			return it == _slot_of.end() ? nullptr : &_values[it->second];
+		}
+		const T* find(uint32_t id) const {
+			auto it = _slot_of.find(id);
+			return it == _slot_of.end() ? nullptr : &_values[it->second];
+		}
+
+		T& at(uint32_t id) { return _values[_slot_of.at(id)]; }
+		const T& at(uint32_t id) const { return _values[_slot_of.at(id)]; }
+
+		void erase(uint32_t id) {
+			auto it = _slot_of.find(id);
+			if (it == _slot_of.end()) {
+				return;
+			}
+
+			const uint32_t slot = it->second;
+			_values[slot] = T{};
+			_alive[slot] = false;
+			_free_slots.push_back(slot);
+			_slot_of.erase(it);
+		}
+
+		void clear(void) {
+			_values.clear();
+			_ids.clear();
+			_alive.clear();
+			_free_slots.clear();
+			_slot_of.clear();
+		}
+
+		size_t size(void) const { return _slot_of.size(); }
+		bool empty(void) const { return _slot_of.empty(); }
+
+		iterator begin(void) { return {this, 0}; }
+		iterator end(void) { return {this, _values.size()}; }
+		const_iterator begin(void) const { return {this, 0}; }
+		const_iterator end(void) const { return {this, _values.size()}; }
+
+	public: // for the iterator
+		size_t slot_count(void) const { return _values.size(); }
+		bool slot_alive(size_t slot) const { return _alive[slot]; }
+		uint32_t slot_id(size_t slot) const { return _ids[slot]; }
+		T& slot_value(size_t slot) { return _values[slot]; }
+		const T& slot_value(size_t slot) const { return _values[slot]; }
+};
+
+} // MM::Tox
+
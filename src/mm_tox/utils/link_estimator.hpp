@@ -0,0 +1,144 @@
+#pragma once
+
+#include <chrono>
+#include <algorithm>
+#include <cstdint>
+#include <cstddef>
+
+namespace MM::Tox {
+
+// per friend view of the link, fed with what was sent, SENDQ failures and ping/pong rtts.
+// once per window, it derives a recommended send budget (bytes/s), AIMD style:
+// back off on loss, SENDQ or queueing delay (rtt well above the best seen), otherwise grow while in use.
+// pongs also carry the remote wall clock, which gives an estimate of the clock offset for time sync.
+class LinkEstimator {
+	public:
+		using clock = std::chrono::steady_clock;
+
+		static constexpr size_t budget_min = 4*1024;
+		static constexpr size_t budget_max = 4*1024*1024;
+		static constexpr size_t budget_step = 16*1024; // additive increase per window
+		static constexpr float budget_backoff = 0.7f; // multiplicative decrease
+
+		static constexpr size_t budget_initial_udp = 256*1024;
+		static constexpr size_t budget_initial_tcp = 32*1024;
+
+		static constexpr clock::duration window {std::chrono::seconds(1)};
+
+	private:
+		clock::time_point _window_start {};
+
+		// this window
+		size_t _bytes {0};
+		uint32_t _sendq_fails {0};
+		uint32_t _pings_sent {0};
+		uint32_t _pongs {0};
+		float _rtt_max_ms {0.f};
+
+		// results
+		float _send_rate {0.f}; // bytes/s
+		float _loss {0.f}; // 0-1, smoothed
+		float _rtt_ms {0.f}; // smoothed, 0 until the first pong
+		float _rtt_var_ms {0.f};
+		float _rtt_min_ms {0.f}; // best seen, baseline for queueing delay
+		float _rtt_last_ms {0.f};
+		float _jitter_ms {0.f}; // smoothed rtt change between pongs, like rfc 3550
+		double _clock_offset_ms {0.}; // remote - local wall clock
+		bool _clock_synced {false};
+		size_t _budget {budget_initial_tcp};
+
+	public:
+		// resets, the initial budget depends on the connection type
+		void reset(bool udp, clock::time_point now) {
+			*this = {};
+			_budget = udp ? budget_initial_udp : budget_initial_tcp;
+			_window_start = now;
+		}
+
+		void on_sent(size_t bytes) { _bytes += bytes; }
+		void on_sendq(void) { _sendq_fails++; }
+		void on_ping_sent(void) { _pings_sent++; }
+
+		void on_pong(float rtt_ms) {
+			_pongs++;
+			_rtt_max_ms = std::max(_rtt_max_ms, rtt_ms);
+
+			// like tcp's srtt/rttvar
+			if (_rtt_ms == 0.f) {
+				_rtt_ms = rtt_ms;
+				_rtt_var_ms = rtt_ms / 2.f;
+				_rtt_min_ms = rtt_ms;
+			} else {
+				const float delta = rtt_ms > _rtt_last_ms ? rtt_ms - _rtt_last_ms : _rtt_last_ms - rtt_ms;
+				_jitter_ms += (delta - _jitter_ms) / 16.f;
+
+				const float diff = rtt_ms > _rtt_ms ? rtt_ms - _rtt_ms : _rtt_ms - rtt_ms;
+				_rtt_var_ms = 0.75f * _rtt_var_ms + 0.25f * diff;
+				_rtt_ms = 0.875f * _rtt_ms + 0.125f * rtt_ms;
+				_rtt_min_ms = std::min(_rtt_min_ms, rtt_ms);
+			}
+			_rtt_last_ms = rtt_ms;
+		}
+
+		// offset_ms: remote wall clock at the pong, minus ours at the time the remote sent it (assuming symmetric paths).
+		// call after on_pong(), samples that queued are skipped, the error of a sample is up to half its rtt
+		void on_clock_sample(double offset_ms, float rtt_ms) {
+			if (!_clock_synced) {
+				_clock_offset_ms = offset_ms;
+				_clock_synced = true;
+				return;
+			}
+
+			if (rtt_ms > 1.5f * _rtt_min_ms + 5.f) {
+				return;
+			}
+
+			_clock_offset_ms += (offset_ms - _clock_offset_ms) * 0.125;
+		}
+
+		// call regularly, only does something once per window
+		void update(clock::time_point now) {
+			const auto elapsed = now - _window_start;
+			if (elapsed < window) {
+				return;
+			}
+
+			const float seconds = std::chrono::duration<float>(elapsed).count();
+			_send_rate = _bytes / seconds;
+
+			if (_pings_sent > 0) {
+				const float window_loss = _pongs >= _pings_sent ? 0.f : 1.f - float(_pongs) / _pings_sent;
+				_loss = 0.75f * _loss + 0.25f * window_loss;
+			}
+
+			const bool queueing = _rtt_min_ms > 0.f && _rtt_max_ms > 2.f * _rtt_min_ms + 20.f;
+			if (_sendq_fails > 0 || _loss > 0.05f || queueing) {
+				_budget = static_cast<size_t>(_budget * budget_backoff);
+			} else if (_send_rate > 0.8f * _budget) {
+				// only probe for more if we actually use what we have
+				_budget += budget_step;
+			}
+			_budget = std::clamp(_budget, budget_min, budget_max);
+
+			_window_start = now;
+			_bytes = 0;
+			_sendq_fails = 0;
+			_pings_sent = 0;
+			_pongs = 0;
+			_rtt_max_ms = 0.f;
+		}
+
+		size_t budget(void) const { return _budget; } // bytes/s
+		float send_rate(void) const { return _send_rate; } // bytes/s
+		float loss(void) const { return _loss; }
+		float rtt_ms(void) const { return _rtt_ms; }
+		float rtt_var_ms(void) const { return _rtt_var_ms; }
+		float jitter_ms(void) const { return _jitter_ms; }
+
+		// false until the first pong
+		bool clock_synced(void) const { return _clock_synced; }
+		// add to a local wall clock time (ms) to get the remote's
+		double clock_offset_ms(void) const { return _clock_offset_ms; }
+};
+
+} // MM::Tox
@@ -0,0 +1,173 @@
+#include "./lz_codec.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+namespace MM::Tox {
+
+static constexpr size_t hash_bits = 12;
+static constexpr uint32_t hash_invalid = 0xffffffffu;
+
+static uint32_t read32(const uint8_t* p) {
+	uint32_t v;
+	std::memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static uint32_t hash4(uint32_t v) {
+	return (v * 2654435761u) >> (32 - hash_bits);
+}
+
+static void put_length(std::vector<uint8_t>& out, size_t n) {
+	for (; n >= 255; n -= 255) {
+		out.push_back(255);
+	}
+	out.push_back(static_cast<uint8_t>(n));
+}
+
+static void put_sequence(std::vector<uint8_t>& out, const uint8_t* literals, size_t literal_count, size_t offset, size_t match_length) {
+	const size_t match_code = match_length >= LZCodec::min_match ? match_length - LZCodec::min_match : 0;
+
+	out.push_back(static_cast<uint8_t>((std::min<size_t>(literal_count, 15) << 4) | std::min<size_t>(match_code, 15)));
+	if (literal_count >= 15) {
+		put_length(out, literal_count - 15);
+	}
+	out.insert(out.end(), literals, literals + literal_count);
+
+	if (match_length == 0) {
+		return; // last sequence
+	}
+
+	out.push_back(offset & 0xff);
+	out.push_back((offset >> 8) & 0xff);
+	if (match_code >= 15) {
+		put_length(out, match_code - 15);
+	}
+}
+
+size_t LZCodec::compress(const uint8_t* src, size_t src_size, std::vector<uint8_t>& out, const uint8_t* dict, size_t dict_size) {
+	const size_t out_size_before = out.size();
+
+	// dictionary (the part still in reach) followed by the input, so matches can cross over.
+	// kept around, steady state does not allocate
+	thread_local std::vector<uint8_t> buf;
+	thread_local std::vector<uint32_t> table;
+
+	const size_t dict_use = dict != nullptr ? std::min(dict_size, max_offset) : 0;
+	buf.clear();
+	buf.insert(buf.end(), dict + dict_size - dict_use, dict + dict_size);
+	buf.insert(buf.end(), src, src + src_size);
+
+	table.assign(size_t(1) << hash_bits, hash_invalid);
+
+	const uint8_t* data = buf.data();
+	const size_t end = buf.size();
+
+	for (size_t p = 0; p + min_match <= dict_use; p++) {
+		table[hash4(read32(data + p))] = static_cast<uint32_t>(p);
+	}
+
+	size_t anchor = dict_use;
+	size_t p = dict_use;
+	while (p + min_match <= end) {
+		const uint32_t v = read32(data + p);
+		const uint32_t h = hash4(v);
+		const uint32_t cand = table[h];
+		table[h] = static_cast<uint32_t>(p);
+
+		if (cand == hash_invalid || p - cand > max_offset || read32(data + cand) != v) {
+			p++;
+			continue;
+		}
+
+		size_t len = min_match;
+		while (p + len < end && data[cand + len] == data[p + len]) {
+			len++;
+		}
+
+		put_sequence(out, data + anchor, p - anchor, p - cand, len);
+
+		// keep the table useful across the match, without hashing every byte
+		for (size_t i = p + 1; i + min_match <= end && i < p + len; i += 2) {
+			table[hash4(read32(data + i))] = static_cast<uint32_t>(i);
+		}
+
+		p += len;
+		anchor = p;
+	}
+
+	put_sequence(out, data + anchor, end - anchor, 0, 0);
+
+	return out.size() - out_size_before;
+}
+
+bool LZCodec::decompress(const uint8_t* src, size_t src_size, uint8_t* dst, size_t dst_size, const uint8_t* dict, size_t dict_size) {
+	if (dict == nullptr) {
+		dict_size = 0;
+	}
+
+	size_t s = 0;
+	size_t d = 0;
+
+	const auto get_length = [&](size_t& n) -> bool {
+		while (true) {
+			if (s >= src_size) {
+				return false;
+			}
+			const uint8_t b = src[s++];
+			n += b;
+			if (b != 255) {
+				return true;
+			}
+		}
+	};
+
+	while (s < src_size) {
+		const uint8_t token = src[s++];
+
+		size_t literal_count = token >> 4;
+		if (literal_count == 15 && !get_length(literal_count)) {
+			return false;
+		}
+		if (literal_count > src_size - s || literal_count > dst_size - d) {
+			return false;
+		}
+		std::memcpy(dst + d, src + s, literal_count);
+		s += literal_count;
+		d += literal_count;
+
+		if (s == src_size) {
+			break; // last sequence
+		}
+
+		if (src_size - s < 2) {
+			return false;
+		}
+		const size_t offset = src[s] | (size_t(src[s+1]) << 8);
+		s += 2;
+
+		size_t match_length = token & 0x0f;
+		if (match_length == 15 && !get_length(match_length)) {
+			return false;
+		}
+		match_length += min_match;
+
+		if (offset == 0 || offset > d + dict_size || match_length > dst_size - d) {
+			return false;
+		}
+
+		// byte wise, matches may overlap themselves
+		for (size_t i = 0; i < match_length; i++, d++) {
+			if (offset > d) {
+				dst[d] = dict[dict_size - (offset - d)];
+			} else {
+				dst[d] = dst[d - offset];
+			}
+		}
+	}
+
+	return d == dst_size;
+}
+
+} // MM::Tox
+
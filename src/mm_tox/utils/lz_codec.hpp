@@ -0,0 +1,46 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+namespace MM::Tox {
+
+// small lz77 block codec (lz4 like layout), for network payloads.
+// no framing, the caller has to transmit the uncompressed size.
+//
+// a sequence is: token (literal count << 4 | match length - 4), literal count extension,
+// literals, match offset (2, le), match length extension. the last sequence has literals only.
+// extensions are 255 bytes until one is < 255, added up.
+//
+// an optional dictionary acts as data in front of the input, matches may reach into it.
+// both sides need the exact same dictionary.
+class LZCodec {
+	public:
+		static constexpr size_t min_match = 4;
+		static constexpr size_t max_offset = 0xffff;
+
+		// worst case output size for size bytes of input
+		static constexpr size_t bound(size_t size) { return size + size / 255 + 16; }
+
+		// most output size bytes of compressed input can decode to.
+		// a match sequence is at least 3 bytes and each extension byte adds at most 255
+		static constexpr size_t max_decompressed(size_t size) { return size * 255 + 16; }
+
+		// appends to out, returns the number of bytes appended
+		static size_t compress(
+			const uint8_t* src, size_t src_size,
+			std::vector<uint8_t>& out,
+			const uint8_t* dict = nullptr, size_t dict_size = 0
+		);
+
+		// false if src is malformed or does not decompress to exactly dst_size bytes
+		static bool decompress(
+			const uint8_t* src, size_t src_size,
+			uint8_t* dst, size_t dst_size,
+			const uint8_t* dict = nullptr, size_t dict_size = 0
+		);
+};
+
+} // MM::Tox
+
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <memory>
+#include <atomic>
+#include <utility>
+#include <cstddef>
+#include <cstdint>
+
+namespace MM::Tox {
+
+// bounded, lock-free, multi producer single consumer queue (per slot sequence numbers, after D. Vyukov)
+// any thread may push(), exactly one thread may pop()
+template<typename T>
+class MPSCQueue {
+	private:
+		struct Slot {
+			std::atomic<size_t> seq; // == pos: free for the push at pos, == pos+1: holds the value pushed at pos
+			T value;
+		};
+
+		const size_t _capacity;
+		std::unique_ptr<Slot[]> _slots;
+
+		alignas(64) std::atomic<size_t> _head {0}; // next pos to pop, only written by the consumer
+		alignas(64) std::atomic<size_t> _tail {0}; // next pos to push, claimed by the producers
+
+	public:
+		explicit MPSCQueue(size_t capacity) : _capacity(capacity), _slots(new Slot[capacity]) {
+			for (size_t i = 0; i < _capacity; i++) {
+				_slots[i].seq.store(i, std::memory_order_relaxed);
+			}
+		}
+
+		MPSCQueue(const MPSCQueue&) = delete;
+		MPSCQueue& operator=(const MPSCQueue&) = delete;
+
+		// any thread, returns false if full (value is left untouched)
+		bool push(T&& value) {
+			size_t pos = _tail.load(std::memory_order_relaxed);
+			Slot* slot = nullptr;
+
+			while (true) {
+				slot = &_slots[pos % _capacity];
+				const size_t seq = slot->seq.load(std::memory_order_acquire);
+				const intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+
+				if (diff == 0) {
+					// free, try to claim it
+					if (_tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+						break;
+					}
+				} else if (diff < 0) {
+					return false; // still holds the value from one lap ago
+				} else {
+					pos = _tail.load(std::memory_order_relaxed); // someone else claimed it
+				}
+			}
+
+			slot->value = std::move(value);
+			slot->seq.store(pos + 1, std::memory_order_release);
+			return true;
+		}
+
+		// consumer only, returns false if empty (or the next push is not finished yet)
+		bool pop(T& value) {
+			const size_t pos = _head.load(std::memory_order_relaxed);
+			Slot& slot = _slots[pos % _capacity];
+
+			if (slot.seq.load(std::memory_order_acquire) != pos + 1) {
+				return false;
+			}
+
+			value = std::move(slot.value);
+			slot.seq.store(pos + _capacity, std::memory_order_release); // free for the next lap
+			_head.store(pos + 1, std::memory_order_release);
+			return true;
+		}
+
+		// only a snapshot, if called by a thread other than the consumer
+		bool empty(void) const {
+			return size() == 0;
+		}
+
+		// only a snapshot, pushes in progress count as queued
+		size_t size(void) const {
+			const size_t head = _head.load(std::memory_order_acquire);
+			const size_t tail = _tail.load(std::memory_order_acquire);
+			return tail > head ? tail - head : 0;
+		}
+
+		size_t capacity(void) const { return _capacity; }
+};
+
+} // MM::Tox
@@ -0,0 +1,161 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <cassert>
+
+namespace MM::Tox {
+
+// non owning view of a single packet, lives as long as the slot it points into
+struct PacketView {
+	uint8_t* _data {nullptr};
+	size_t _size {0};
+
+	uint8_t* data(void) const { return _data; }
+	size_t size(void) const { return _size; }
+	bool empty(void) const { return _size == 0; }
+
+	uint8_t& operator[](size_t i) const { return _data[i]; }
+
+	uint8_t* begin(void) const { return _data; }
+	uint8_t* end(void) const { return _data + _size; }
+	const uint8_t* cbegin(void) const { return _data; }
+	const uint8_t* cend(void) const { return _data + _size; }
+};
+
+// ring of fixed size slots (eg. tox_max_custom_packet_size()).
+// slots are reused across ticks, so after warming up, pushing does not allocate.
+// it only grows (doubling) if more packets are queued at once than ever before, shrink() gives a burst back.
+class PacketRing {
+	private:
+		size_t _slot_size {0};
+
+		std::vector<uint8_t> _mem; // capacity * _slot_size
+		std::vector<uint16_t> _sizes; // per slot, 0 marks an erased packet
+
+		size_t _head {0}; // slot of the first packet
+		size_t _count {0};
+
+		static constexpr size_t initial_capacity = 8;
+
+	public:
+		explicit PacketRing(size_t slot_size) : _slot_size(slot_size) {
+			assert(slot_size <= UINT16_MAX);
+		}
+
+		size_t capacity(void) const { return _sizes.size(); }
+		size_t size(void) const { return _count; } // including erased
+		bool empty(void) const { return _count == 0; }
+
+		// copies data into the next slot, false if it does not fit a slot
+		bool push(const uint8_t* data, size_t size) {
+			if (size == 0 || size > _slot_size) {
+				return false;
+			}
+
+			if (_count == capacity()) {
+				grow();
+			}
+
+			const size_t slot = (_head + _count) % capacity();
+			std::memcpy(_mem.data() + slot * _slot_size, data, size);
+			_sizes[slot] = static_cast<uint16_t>(size);
+			_count++;
+
+			return true;
+		}
+
+		// copies head and body back to back into the next slot, false if they do not fit a slot
+		bool push(const uint8_t* head, size_t head_size, const uint8_t* body, size_t body_size) {
+			const size_t size = head_size + body_size;
+			if (size == 0 || size > _slot_size) {
+				return false;
+			}
+
+			if (_count == capacity()) {
+				grow();
+			}
+
+			const size_t slot = (_head + _count) % capacity();
+			std::memcpy(_mem.data() + slot * _slot_size, head, head_size);
+			if (body_size > 0) {
+				std::memcpy(_mem.data() + slot * _slot_size + head_size, body, body_size);
+			}
+			_sizes[slot] = static_cast<uint16_t>(size);
+			_count++;
+
+			return true;
+		}
+
+		void pop_front(void) {
+			assert(_count > 0);
+			_head = (_head + 1) % capacity();
+			_count--;
+		}
+
+		// keeps the slot, but each() skips it from now on
+		void erase(size_t i) {
+			assert(i < _count);
+			_sizes[(_head + i) % capacity()] = 0;
+		}
+
+		// keeps the memory
+		void clear(void) {
+			_head = 0;
+			_count = 0;
+		}
+
+		// frees the slots if empty and there are more than max_capacity (eg. left from a burst).
+		// the next push grows from the start again
+		void shrink(size_t max_capacity) {
+			if (_count != 0 || capacity() <= max_capacity) {
+				return;
+			}
+
+			_mem = {};
+			_sizes = {};
+			_head = 0;
+		}
+
+		PacketView operator[](size_t i) {
+			assert(i < _count);
+			const size_t slot = (_head + i) % capacity();
+			return {_mem.data() + slot * _slot_size, _sizes[slot]};
+		}
+
+		// fn(PacketView&), in order, skips erased ones
+		template<typename Fn>
+		void each(Fn&& fn) {
+			for (size_t i = 0; i < _count; i++) {
+				PacketView view = (*this)[i];
+				if (!view.empty()) {
+					fn(view);
+				}
+			}
+		}
+
+	private:
+		void grow(void) {
+			const size_t old_capacity = capacity();
+			const size_t new_capacity = old_capacity == 0 ? initial_capacity : old_capacity * 2;
+
+			std::vector<uint8_t> new_mem(new_capacity * _slot_size);
+			std::vector<uint16_t> new_sizes(new_capacity, 0);
+
+			// unwrap while moving over
+			for (size_t i = 0; i < _count; i++) {
+				const size_t slot = (_head + i) % old_capacity;
+				std::memcpy(new_mem.data() + i * _slot_size, _mem.data() + slot * _slot_size, _sizes[slot]);
+				new_sizes[i] = _sizes[slot];
+			}
+
+			_mem.swap(new_mem);
+			_sizes.swap(new_sizes);
+			_head = 0;
+		}
+};
+
+} // MM::Tox
+
@@ -0,0 +1,55 @@
+#include "./save_writer.hpp"
+
+#include <mm/logger.hpp>
+#define LOG_ERROR(...)		__LOG_ERROR("MM::Tox", __VA_ARGS__)
+#define LOG_TRACE(...)		__LOG_TRACE("MM::Tox", __VA_ARGS__)
+
+namespace MM::Tox {
+
+SaveWriter::SaveWriter(write_fn fn) : _write_fn(std::move(fn)) {
+	_thread = std::thread([this]() { thread_main(); });
+}
+
+SaveWriter::~SaveWriter(void) {
+	{
+		std::lock_guard lg{_mutex};
+		_quit = true;
+	}
+	_cv.notify_one();
+	_thread.join();
+}
+
+void SaveWriter::submit(std::vector<uint8_t>& snapshot) {
+	{
+		std::lock_guard lg{_mutex};
+		if (_has_pending) {
+			LOG_TRACE("coalescing savefile write");
+		}
+		_pending.swap(snapshot);
+		_has_pending = true;
+	}
+	_cv.notify_one();
+}
+
+void SaveWriter::thread_main(void) {
+	std::unique_lock lk{_mutex};
+	while (true) {
+		_cv.wait(lk, [this]() { return _quit || _has_pending; });
+
+		if (_has_pending) {
+			_writing.swap(_pending);
+			_has_pending = false;
+
+			lk.unlock();
+			if (!_write_fn(_writing.data(), _writing.size())) {
+				LOG_ERROR("writing the savefile failed");
+			}
+			lk.lock();
+		} else if (_quit) {
+			break;
+		}
+	}
+}
+
+} // MM::Tox
+
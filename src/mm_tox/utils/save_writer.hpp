@@ -0,0 +1,48 @@
+#pragma once
+
+#include <vector>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cstdint>
+
+namespace MM::Tox {
+
+// writes the toxsave from a background thread.
+// a newer snapshot replaces an older one not yet written (coalescing).
+// how it ends up on disk is up to the write fn, it runs on the writer thread
+class SaveWriter {
+	public:
+		using write_fn = std::function<bool(const uint8_t* data, size_t size)>;
+
+	private:
+		const write_fn _write_fn;
+
+		std::thread _thread;
+		std::mutex _mutex;
+		std::condition_variable _cv; // wakes the writer
+
+		bool _quit {false};
+		bool _has_pending {false};
+
+		// buffers get swapped around, so steady state does not allocate
+		std::vector<uint8_t> _pending;
+		std::vector<uint8_t> _writing;
+
+	public:
+		explicit SaveWriter(write_fn fn);
+		~SaveWriter(void); // writes what is pending
+
+		SaveWriter(const SaveWriter&) = delete;
+		SaveWriter& operator=(const SaveWriter&) = delete;
+
+		// takes the content of snapshot, leaving a recycled buffer in its place
+		void submit(std::vector<uint8_t>& snapshot);
+
+	private:
+		void thread_main(void);
+};
+
+} // MM::Tox
+
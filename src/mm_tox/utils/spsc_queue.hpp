@@ -0,0 +1,60 @@
+#pragma once
+
+#include <vector>
+#include <atomic>
+#include <utility>
+#include <cstddef>
+
+namespace MM::Tox {
+
+// bounded, lock-free, single producer single consumer queue
+// exactly one thread may push() and exactly one (other) thread may pop()
+template<typename T>
+class SPSCQueue {
+	private:
+		std::vector<T> _slots; // one slot always stays empty, to tell full from empty
+
+		alignas(64) std::atomic<size_t> _head {0}; // next slot to pop, only written by the consumer
+		alignas(64) std::atomic<size_t> _tail {0}; // next slot to push, only written by the producer
+
+	public:
+		explicit SPSCQueue(size_t capacity) : _slots(capacity + 1) {}
+
+		SPSCQueue(const SPSCQueue&) = delete;
+		SPSCQueue& operator=(const SPSCQueue&) = delete;
+
+		// producer only, returns false if full (value is left untouched)
+		bool push(T&& value) {
+			const size_t tail = _tail.load(std::memory_order_relaxed);
+			const size_t next = (tail + 1) % _slots.size();
+			if (next == _head.load(std::memory_order_acquire)) {
+				return false;
+			}
+
+			_slots[tail] = std::move(value);
+			_tail.store(next, std::memory_order_release);
+			return true;
+		}
+
+		// consumer only, returns false if empty
+		bool pop(T& value) {
+			const size_t head = _head.load(std::memory_order_relaxed);
+			if (head == _tail.load(std::memory_order_acquire)) {
+				return false;
+			}
+
+			value = std::move(_slots[head]);
+			_head.store((head + 1) % _slots.size(), std::memory_order_release);
+			return true;
+		}
+
+		// only a snapshot, if called by a thread other than producer or consumer
+		bool empty(void) const {
+			return _head.load(std::memory_order_acquire) == _tail.load(std::memory_order_acquire);
+		}
+
+		size_t capacity(void) const { return _slots.size() - 1; }
+};
+
+} // MM::Tox
+